@@ -0,0 +1,22 @@
+Import("env")
+
+import gzip
+import os
+import shutil
+
+# Web interface files are gzipped into the filesystem image directory (data_dir in platformio.ini).
+# mtime is fixed so unchanged files produce identical archives and keep their ETag.
+
+source = os.path.join(env.subst("$PROJECT_DIR"), "data")
+target = env.subst("$PROJECT_DATA_DIR")
+
+if os.path.isdir(target):
+    shutil.rmtree(target)
+os.makedirs(target)
+
+for name in sorted(os.listdir(source)):
+    with open(os.path.join(source, name), "rb") as file:
+        data = file.read()
+    with open(os.path.join(target, name + ".gz"), "wb") as file:
+        with gzip.GzipFile(filename="", mode="wb", compresslevel=9, fileobj=file, mtime=0) as archive:
+            archive.write(data)
@@ -21,13 +21,12 @@ function load() {
 
 function loadBlock() {
     newData = JSON.parse(xmlHttp.responseText);
-    data = document.getElementsByTagName('body')[0].innerHTML;
-    var newString;
     for (var key in newData) {
-        newString = data.replace(new RegExp('{{' + key + '}}', 'g'), newData[key]);
-        data = newString;
+        var element = document.getElementById(key);
+        if (element) {
+            element.value = newData[key];
+        }
     }
-    document.getElementsByTagName('body')[0].innerHTML = newString;
     setFirmvareValue('version', 'firmware');
     setGpioValue('workModeSelect', 'workMode');
     handleServerResponse();
@@ -54,7 +53,7 @@ function saveSetting(submit) {
     server = "/setting?ssid=" + getValue('ssid') + "&password=" + encodeURIComponent(getValue('password'))
         + "&mqttHostName=" + getValue('mqttHostName') + "&mqttHostPort=" + getValue('mqttHostPort')
         + "&mqttUserLogin=" + getValue('mqttUserLogin') + "&mqttUserPassword=" + encodeURIComponent(getValue('mqttUserPassword'))
-        + "&topicPrefix=" + getValue('topicPrefix')
+        + "&topicPrefix=" + getValue('topicPrefix') + "&mqttWindow=" + getValue('mqttWindow')
         + "&deviceName=" + getValue('deviceName')
         + "&espnowNetName=" + getValue('espnowNetName')
         + "&workMode=" + getSelectValue('workModeSelect')
@@ -76,4 +75,26 @@ function setFirmvareValue(id, value) {
 function setGpioValue(id, value) {
     var select = document.getElementById(id);
     select.value = document.getElementById(value).value;
+}
+
+var trafficSocket;
+var trafficLines = [];
+function showTraffic(submit) {
+    var traffic = document.getElementById('traffic');
+    traffic.hidden = false;
+    if (trafficSocket) {
+        trafficSocket.close();
+    }
+    trafficLines = [];
+    trafficSocket = new WebSocket('ws://' + location.host + '/traffic');
+    trafficSocket.onopen = function () {
+        trafficSocket.send(JSON.stringify({ MAC: getValue('trafficMac'), type: getValue('trafficType') }));
+    }
+    trafficSocket.onmessage = function (event) {
+        trafficLines.unshift(event.data);
+        if (trafficLines.length > 50) {
+            trafficLines.pop();
+        }
+        traffic.textContent = trafficLines.join('\n');
+    }
 }
\ No newline at end of file
@@ -0,0 +1,260 @@
+#include "downlink_path.h"
+
+downlink_command_t downlinkQueue[downlinkQueueSize];
+uint8_t downlinkQueueCount{0};
+uint32_t downlinkMergedCounter{0};
+uint32_t downlinkRetriedCounter{0};
+uint32_t downlinkDeliveredCounter{0};
+uint32_t downlinkFailedCounter{0};
+uint32_t downlinkOverflowCounter{0};
+
+void onMqttMessage(char *topic, byte *payload, unsigned int length)
+{
+    const char *topicPrefix = getTopicPrefix();
+    size_t prefixLength = strlen(topicPrefix);
+    if (strncmp(topic, topicPrefix, prefixLength) || topic[prefixLength] != '/')
+        return;
+    char *deviceType = topic + prefixLength + 1; // Topic is split in place: <prefix>/<device type>/<MAC>[/<command>].
+    char *mac = strchr(deviceType, '/');
+    if (!mac)
+        return;
+    *mac++ = '\0';
+    char *command = strchr(mac, '/');
+    if (command)
+        *command++ = '\0';
+    uint8_t target[6];
+    if (!hexToMac(mac, target))
+        return;
+    char message[sizeof(esp_now_payload_data_t::message)]{0};
+    memcpy(message, payload, length < sizeof(message) ? length : sizeof(message) - 1);
+    bool isRestart = !strcmp(message, "restart");
+    bool isUpdate = !strcmp(message, "update");
+    if (!strcmp(deviceType, "espnow_gateway"))
+    {
+        if (!command && isRestart && !strcmp(getGatewayMac(), mac))
+            restartGateway();
+        return;
+    }
+    const char *deviceTypeName{nullptr};
+    for (const char *name : mqttCommandDeviceTypes)
+        if (!strcmp(deviceType, name))
+            deviceTypeName = name;
+    if (!deviceTypeName)
+        return;
+    const char *key{nullptr};
+    if (command)
+        for (const mqtt_command_t &mqttCommand : mqttCommands)
+            if (!strcmp(deviceType, mqttCommand.deviceType) && !strcmp(command, mqttCommand.command))
+            {
+                key = mqttCommand.command;
+                break;
+            }
+    if (!key && !isRestart && !isUpdate)
+        return;
+    esp_now_payload_type_t payloadsType = isRestart ? ENPT_RESTART : isUpdate ? ENPT_UPDATE : ENPT_SET;
+    queueDownlinkCommand(target, deviceTypeName, payloadsType, key, message);
+}
+
+void confirmDownlinkCommand(const uint16_t id, const bool status)
+{
+    for (downlink_command_t &entry : downlinkQueue)
+        if (entry.state == DLS_SENDING && entry.messageId == id)
+        {
+            entry.state = status ? DLS_DELIVERED : DLS_REJECTED; // Handled in processDownlinkQueue().
+            return;
+        }
+}
+
+void queueDownlinkCommand(const uint8_t *target, const char *deviceType, const esp_now_payload_type_t payloadsType, const char *command, const char *value)
+{
+    downlink_command_t *entry{nullptr};
+    downlink_command_t *available{nullptr};
+    for (downlink_command_t &candidate : downlinkQueue)
+    {
+        if (candidate.state == DLS_FREE)
+        {
+            if (!available)
+                available = &candidate;
+            continue;
+        }
+        if (!candidate.isFull && candidate.payloadsType == payloadsType && !memcmp(candidate.target, target, 6))
+        {
+            entry = &candidate;
+            break;
+        }
+    }
+    if (entry)
+    {
+        if (mergeDownlinkCommand(*entry, command, value))
+        {
+            ++downlinkMergedCounter;
+            if (entry->state != DLS_MERGING)
+                entry->isChanged = true;
+            return;
+        }
+        entry->isFull = true;
+    }
+    if (!available)
+    {
+        ++downlinkOverflowCounter;
+        return;
+    }
+    entry = available;
+    memcpy(entry->target, target, 6);
+    entry->deviceType = deviceType;
+    entry->payloadsType = payloadsType;
+    entry->message[0] = '\0';
+    entry->isChanged = false;
+    entry->isFull = false;
+    entry->attempts = 0;
+    if (!mergeDownlinkCommand(*entry, command, value)) // Does not fit a frame even on its own.
+    {
+        ++downlinkFailedCounter;
+        publishDownlinkAck(*entry, false);
+        return;
+    }
+    entry->deadline = millis() + downlinkMergeWindow;
+    entry->state = DLS_MERGING;
+    ++downlinkQueueCount;
+}
+
+bool mergeDownlinkCommand(downlink_command_t &entry, const char *command, const char *value)
+{
+    PooledJsonDocument json(sizeof(esp_now_payload_data_t::message) * 2);
+    if (entry.message[0])
+        deserializeJson(json, (const char *)entry.message); // Copy mode, the buffer is rewritten below.
+    if (command)
+        json[command] = value;
+    if (json.overflowed() || measureJson(json) >= sizeof(entry.message)) // Would be truncated. The entry is left unchanged.
+        return false;
+    serializeJson(json, entry.message, sizeof(entry.message));
+    return true;
+}
+
+void processDownlinkQueue()
+{
+    for (downlink_command_t &entry : downlinkQueue)
+    {
+        bool isExpired = (int32_t)(millis() - entry.deadline) >= 0;
+        switch (entry.state)
+        {
+        case DLS_MERGING:
+        case DLS_RETRY:
+            if (isExpired)
+                sendDownlinkCommand(entry);
+            break;
+        case DLS_SENDING:
+            if (isExpired)
+                failDownlinkCommand(entry);
+            break;
+        case DLS_DELIVERED:
+            if (entry.isChanged) // Send again with the commands merged in meanwhile.
+            {
+                entry.attempts = 0;
+                sendDownlinkCommand(entry);
+                break;
+            }
+            ++downlinkDeliveredCounter;
+            publishDownlinkAck(entry, true);
+            entry.state = DLS_FREE;
+            --downlinkQueueCount;
+            break;
+        case DLS_REJECTED:
+            failDownlinkCommand(entry);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void sendDownlinkCommand(downlink_command_t &entry)
+{
+    esp_now_payload_data_t outgoingData;
+    outgoingData.deviceType = ENDT_GATEWAY;
+    outgoingData.payloadsType = entry.payloadsType;
+    memcpy(&outgoingData.message, &entry.message, sizeof(esp_now_payload_data_t::message));
+    entry.isChanged = false;
+    ++entry.attempts;
+    entry.deadline = millis() + downlinkConfirmTimeout;
+    entry.messageId = 0;
+    ++entry.generation;
+    entry.state = DLS_SENDING;
+    sendEspnowMessage(outgoingData, entry.target, &entry - downlinkQueue);
+    for (uint8_t i{0}; i < deviceRegistryCount; ++i)
+        if (!memcmp(deviceRegistry[i].mac, entry.target, 6))
+            ++deviceRegistry[i].txFrames;
+}
+
+void failDownlinkCommand(downlink_command_t &entry)
+{
+    if (entry.attempts < downlinkMaxAttempts)
+    {
+        ++downlinkRetriedCounter;
+        entry.deadline = millis() + (downlinkRetryDelay << (entry.attempts - 1));
+        entry.state = DLS_RETRY;
+        return;
+    }
+    ++downlinkFailedCounter;
+    publishDownlinkAck(entry, false);
+    entry.state = DLS_FREE;
+    --downlinkQueueCount;
+}
+
+void publishDownlinkAck(const downlink_command_t &entry, const bool isDelivered)
+{
+    if (!isMqttAvailable)
+        return;
+    const uint8_t *mac = entry.target;
+    snprintf(topicBuffer, sizeof(topicBuffer), "%s/%s/%02X%02X%02X%02X%02X%02X/ack", getTopicPrefix(), entry.deviceType, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    char payload[48]{0};
+    snprintf(payload, sizeof(payload), "{\"status\":\"%s\",\"attempts\":%u}", isDelivered ? "delivered" : "failed", entry.attempts);
+    mqttPublish(topicBuffer, payload, false);
+}
+
+void buildKeepAliveMessage(esp_now_payload_data_t &outgoingData, const bool isMqttOnline, const bool isTimeKnown, const uint32_t epochTime)
+{
+    outgoingData.deviceType = ENDT_GATEWAY;
+    outgoingData.payloadsType = ENPT_KEEP_ALIVE;
+    PooledJsonDocument json(sizeof(esp_now_payload_data_t::message));
+    json["MQTT"] = isMqttOnline ? "online" : "offline";
+    json["frequency"] = 10; // For compatibility with the previous version. Will be removed in future releases.
+    char timeBuffer[9]{0};
+    char dateBuffer[11]{0};
+    if (isTimeKnown) // The local clock keeps running when the link or the NTP server is down.
+    {
+        uint32_t seconds = epochTime % 86400;
+        snprintf(timeBuffer, sizeof(timeBuffer), "%02u:%02u:%02u", seconds / 3600, seconds / 60 % 60, seconds % 60);
+        // Civil date from days since 1970 without gmtime(). Valid for the whole uint32_t range.
+        uint32_t days = epochTime / 86400 + 719468;
+        uint32_t era = days / 146097;
+        uint32_t dayOfEra = days - era * 146097;
+        uint32_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+        uint32_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+        uint32_t monthIndex = (5 * dayOfYear + 2) / 153;
+        uint32_t day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+        uint32_t month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+        uint32_t year = yearOfEra + era * 400 + (month <= 2 ? 1 : 0);
+        snprintf(dateBuffer, sizeof(dateBuffer), "%u.%u.%u", day, month, year);
+        json["time"] = (const char *)timeBuffer;
+        json["date"] = (const char *)dateBuffer;
+    }
+    char buffer[sizeof(esp_now_payload_data_t::message)]{0};
+    serializeJsonPretty(json, buffer);
+    memcpy(&outgoingData.message, &buffer, sizeof(esp_now_payload_data_t::message));
+}
+
+bool hexToMac(const char *hex, uint8_t *mac)
+{
+    if (strlen(hex) != 12)
+        return false;
+    for (uint8_t i{0}; i < 12; ++i)
+    {
+        char c = hex[i];
+        uint8_t nibble = c >= '0' && c <= '9' ? c - '0' : c >= 'A' && c <= 'F' ? c - 'A' + 10 : c >= 'a' && c <= 'f' ? c - 'a' + 10 : 16;
+        if (nibble > 15)
+            return false;
+        mac[i / 2] = i % 2 ? (mac[i / 2] << 4) | nibble : nibble;
+    }
+    return true;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "message_path.h"
+
+// MQTT command to ESP-NOW frame path and the gateway keep alive frame. Built into the firmware and into the host program
+// (env:native), which has no radio, broker or flash.
+
+typedef enum : uint8_t
+{
+    DLS_FREE,
+    DLS_MERGING, // Collecting commands until the merge window ends.
+    DLS_SENDING, // Waiting for the ZHNetwork delivery confirmation.
+    DLS_DELIVERED, // Set from the delivery confirmation in loop().
+    DLS_REJECTED, // Set from the delivery confirmation in loop().
+    DLS_RETRY // Waiting for the retry backoff.
+} downlink_state_t;
+
+typedef struct
+{
+    uint8_t target[6]{0};
+    const char *deviceType{nullptr}; // Points into mqttCommandDeviceTypes.
+    esp_now_payload_type_t payloadsType{ENPT_SET};
+    char message[sizeof(esp_now_payload_data_t::message)]{0}; // Merged commands as JSON.
+    uint8_t state{DLS_FREE}; // Changed by loop() only.
+    bool isChanged{false}; // Commands were merged in while the previous frame was in flight.
+    bool isFull{false}; // The last command did not fit. Later commands go into a new entry.
+    uint8_t attempts{0};
+    uint16_t messageId{0};
+    uint8_t generation{0}; // Incremented on every send. Message IDs reported for an earlier send are ignored.
+    uint32_t deadline{0}; // End of the merge window, confirmation timeout or retry backoff.
+} downlink_command_t;
+
+typedef struct
+{
+    const char *deviceType;
+    const char *command; // Also the key of the ESP-NOW set message.
+} mqtt_command_t;
+
+const char *const mqttCommandDeviceTypes[]{"espnow_switch", "espnow_led"};
+const mqtt_command_t mqttCommands[]{
+    {"espnow_switch", "set"},
+    {"espnow_led", "set"},
+    {"espnow_led", "brightness"},
+    {"espnow_led", "temperature"},
+    {"espnow_led", "rgb"}};
+
+const uint8_t downlinkQueueSize{8}; // One entry per target device and payload type.
+const uint8_t downlinkMergeWindow{20}; // In milliseconds. Home Assistant sends the commands of one action back to back.
+const uint16_t downlinkConfirmTimeout{2000}; // In milliseconds.
+const uint16_t downlinkRetryDelay{200}; // In milliseconds. Doubled after each failed attempt.
+const uint8_t downlinkMaxAttempts{4};
+const uint8_t downlinkNoSlot{0xFF}; // Frame without a downlink queue entry. No delivery confirmation.
+
+// Provided by main.cpp on the device and by the host program.
+void sendEspnowMessage(const esp_now_payload_data_t &data, const uint8_t *target, const uint8_t slot);
+const char *getGatewayMac(void);
+void restartGateway(void);
+extern bool isMqttAvailable;
+
+void onMqttMessage(char *topic, byte *payload, unsigned int length);
+void confirmDownlinkCommand(const uint16_t id, const bool status);
+void queueDownlinkCommand(const uint8_t *target, const char *deviceType, const esp_now_payload_type_t payloadsType, const char *command, const char *value);
+bool mergeDownlinkCommand(downlink_command_t &entry, const char *command, const char *value);
+void processDownlinkQueue(void);
+void sendDownlinkCommand(downlink_command_t &entry);
+void failDownlinkCommand(downlink_command_t &entry);
+void publishDownlinkAck(const downlink_command_t &entry, const bool isDelivered);
+void buildKeepAliveMessage(esp_now_payload_data_t &outgoingData, const bool isMqttOnline, const bool isTimeKnown, const uint32_t epochTime);
+bool hexToMac(const char *hex, uint8_t *mac);
+
+extern downlink_command_t downlinkQueue[downlinkQueueSize];
+extern uint8_t downlinkQueueCount;
+extern uint32_t downlinkMergedCounter;
+extern uint32_t downlinkRetriedCounter;
+extern uint32_t downlinkDeliveredCounter;
+extern uint32_t downlinkFailedCounter;
+extern uint32_t downlinkOverflowCounter;
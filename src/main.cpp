@@ -4,11 +4,15 @@
 #include "Ethernet.h"          // https://github.com/arduino-libraries/Ethernet
 #include "PubSubClient.h"
 #include "LittleFS.h"
-#include "EEPROM.h"
 #include "Ticker.h"
-#include "NTPClient.h"
+#include "EEPROM.h"
+#include "lwip/dns.h"
 #include "ZHNetwork.h"
 #include "ZHConfig.h"
+#include "message_path.h"
+#include "downlink_path.h"
+#include "mqtt_qos1.h"
+#include <atomic>
 #if defined(ESP8266)
 #include "ESP8266SSDP.h"
 #endif
@@ -16,31 +20,216 @@
 #include "ESP32SSDP.h"
 #endif
 
+
+typedef struct
+{
+    const char *path;
+    const char *contentType;
+    char etag[20]; // Empty if only the uncompressed file exists.
+} web_asset_t;
+
+typedef enum : uint8_t
+{
+    TE_CONNECT,
+    TE_DISCONNECT,
+    TE_FILTER
+} traffic_event_type_t;
+
+typedef struct
+{
+    uint32_t id{0};
+    uint8_t type{TE_CONNECT};
+    uint8_t mac[6]{0}; // For TE_FILTER only.
+    bool isMacFiltered{false};
+    uint16_t typeMask{0xFFFF};
+} traffic_event_t;
+
+typedef enum : uint8_t
+{
+    HRS_IDLE,
+    HRS_PENDING,
+    HRS_DONE,
+    HRS_FAILED
+} host_resolver_state_t;
+
+typedef struct
+{
+    std::atomic<uint8_t> state{HRS_IDLE}; // On WiFi set by the lwIP DNS callback, which runs in the tcpip task on ESP32.
+    std::atomic<uint32_t> address{0};
+    const char *hostName{nullptr};
+    uint8_t link{0};
+    uint16_t queryId{0}; // LAN only. The query is sent over the resolver's own socket.
+    uint32_t startTime{0};
+    EthernetUDP udp;
+} host_resolver_t;
+
+typedef struct
+{
+    alignas(String) uint8_t image[sizeof(String)];
+} legacy_string_t; // String object as saved by EEPROM.put(). Only short strings were stored inline, longer ones as a heap pointer.
+
+typedef struct
+{
+    legacy_string_t deviceName;
+    legacy_string_t espnowNetName;
+    uint8_t workMode;
+    legacy_string_t ssid;
+    legacy_string_t password;
+    legacy_string_t mqttHostName;
+    uint16_t mqttHostPort;
+    legacy_string_t mqttUserLogin;
+    legacy_string_t mqttUserPassword;
+    legacy_string_t topicPrefix;
+    legacy_string_t ntpHostName;
+    uint16_t gmtOffset;
+} legacy_config_t;
+
+
+struct chunkedPrint : public Print // Collects single byte writes into chunks before passing them to the network client.
+{
+    Print &target;
+    uint8_t chunk[64];
+    uint8_t length{0};
+    chunkedPrint(Print &target) : target(target) {}
+    size_t write(uint8_t c) override
+    {
+        chunk[length++] = c;
+        if (length == sizeof(chunk))
+            flushChunk();
+        return 1;
+    }
+    void flushChunk()
+    {
+        if (length)
+            target.write(chunk, length);
+        length = 0;
+    }
+};
+
+
+typedef enum : uint8_t
+{
+    CC_NONE,
+    CC_START,
+    CC_STOP,
+    CC_REPLAY_MAX_SPEED, // MQTT publishing is suppressed.
+    CC_REPLAY_ORIGINAL_SPEED
+} capture_command_t;
+
+
 void onEspnowMessage(const char *data, const uint8_t *sender);
+void handleReceivedMessages(void);
+bool isDuplicateMessage(const esp_now_payload_data_t &incomingData, const uint8_t *sender);
 
-void onMqttMessage(char *topic, byte *payload, unsigned int length);
+void onMqttLinkMessage(const uint8_t link, char *topic, byte *payload, unsigned int length);
+bool isDuplicateMqttCommand(const uint8_t link, const char *topic, const byte *payload, const unsigned int length);
 
 void sendKeepAliveMessage(void);
 void sendAttributesMessage(void);
 void sendConfigMessage(void);
 
-String getValue(String data, char separator, uint8_t index);
 
 void loadConfig(void);
 void saveConfig(void);
+bool readConfigRecord(const size_t size, struct deviceConfig &record);
+void readLegacyConfig(void);
+void readLegacyString(const legacy_string_t &legacy, String &value);
+bool readConfigField(const uint8_t *&cursor, const uint8_t *end, String &value);
+bool readConfigField(const uint8_t *&cursor, const uint8_t *end, uint8_t &value);
+bool readConfigField(const uint8_t *&cursor, const uint8_t *end, uint16_t &value);
+bool readConfigField(const uint8_t *&cursor, const uint8_t *end, uint8_t *value, const uint8_t length);
+bool writeConfigField(uint8_t *&cursor, const uint8_t *end, const String &value);
+bool writeConfigField(uint8_t *&cursor, const uint8_t *end, const uint8_t value);
+bool writeConfigField(uint8_t *&cursor, const uint8_t *end, const uint16_t value);
+bool writeConfigField(uint8_t *&cursor, const uint8_t *end, const uint8_t *value, const uint8_t length);
+uint32_t getCrc32(const uint8_t *data, size_t length);
 
 String xmlNode(String tags, String data);
 void setupWebServer(void);
-
-void checkMqttAvailability(void);
+void loadWebAssetTags(void);
+void onTrafficEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t length);
+void applyTrafficEvent(const traffic_event_t &event);
+#if defined(ESP32)
+void handleTrafficEvents(void);
+#endif
+void sendTrafficFrame(const char *direction, const esp_now_payload_data_t &data, const uint8_t *mac, const int32_t latency);
+void sendWebAsset(AsyncWebServerRequest *request, const web_asset_t &asset);
+
+void checkWifiConnection(void);
+void setWifiConnectionState(const uint8_t state);
+
+void checkNtpTime(void);
+bool readNtpResponse(UDP &udp);
+void failNtpRequest(void);
+uint32_t getLocalEpochTime(void);
+
+void startHostResolve(host_resolver_t &resolver, const char *hostName, const uint8_t link);
+uint8_t checkHostResolve(host_resolver_t &resolver, IPAddress &address);
+void onHostResolved(const char *name, const ip_addr_t *ipaddr, void *callbackArg);
+bool sendDnsQuery(host_resolver_t &resolver);
+void readDnsResponse(host_resolver_t &resolver);
+bool skipDnsName(uint16_t &position, const uint16_t length);
+
+bool isMqttLinkEnabled(const uint8_t link);
+bool isMqttLinkUp(const uint8_t link);
+bool isEthernetBusy(void);
+void checkMqttAvailability(const uint8_t link);
+void setMqttConnectionState(const uint8_t link, const uint8_t state);
+void failMqttConnection(const uint8_t link);
+void switchMqttLink(const uint8_t link);
+void sendMqttPing(const uint8_t link);
+void onMqttPing(const uint8_t link);
+bool subscribeMqttTopic(const uint8_t link, const uint8_t index);
+bool connectMqttLink(const uint8_t link);
+#if defined(ESP32)
+void mqttConnectTask(void *parameter);
+#endif
 
 void mqttPublish(const char *topic, const char *payload, bool retained);
+void mqttPublish(const char *topic, const size_t length, bool retained, payload_writer_t writer, const void *context);
+bool publishMqttQos1(PubSubClient &client, const char *topic, const size_t length, bool retained, payload_writer_t writer, const void *context);
+bool readMqttAcks(const uint8_t link);
+void retransmitMqttInflight(void);
+bool isMqttWindowOpen(void);
+void writeText(Print &output, const void *context);
+
+void updateDeviceRegistry(const esp_now_payload_data_t &incomingData, const uint8_t *sender);
+void checkDeviceAvailability(void);
+
+
+void addHistogramValue(uint32_t *histogram, uint32_t value);
+void recordPublishLatency(void);
+void updateHeapMetrics(void);
+void buildMetrics(JsonDocument &json);
+void sendMetricsMessage(void);
+void buildEncodingMetrics(JsonDocument &json);
+
+void queuePendingMessage(const esp_now_payload_data_t &incomingData, const uint8_t *sender, const uint32_t receivedTime);
+void flushPendingSpill(void);
+void replayPendingMessages(void);
+
+
+void onEspnowConfirm(const uint8_t *target, const uint16_t id, const bool status);
+uint16_t transmitEspnowMessage(const esp_now_payload_data_t &data, const uint8_t *target, const bool confirm);
+#if defined(ESP32)
+void radioTask(void *parameter);
+void handleRadioResults(void);
+#endif
+
+void handleCaptureCommand(void);
+void captureFrame(const capture_direction_t direction, const esp_now_payload_data_t &data, const uint8_t *mac);
+void flushCapture(void);
+void startCaptureSegment(const uint8_t index);
+void startCaptureReplay(const bool isOriginalSpeed);
+void replayCaptureFrames(void);
+bool readCaptureRecord(void);
 
 typedef enum : uint8_t
 {
     ESP_NOW,
     ESP_NOW_WIFI,
-    ESP_NOW_LAN
+    ESP_NOW_LAN,
+    ESP_NOW_DUAL
 } work_mode_t;
 
 struct deviceConfig
@@ -62,8 +251,31 @@ struct deviceConfig
     String topicPrefix{"homeassistant"};
     String ntpHostName{"NTP"};
     uint16_t gmtOffset{10800};
+    uint8_t wifiBssid[6]{0}; // Last successfully connected access point. Used to skip the scan at boot.
+    uint8_t wifiChannel{0};
+    uint8_t mqttWindow{8}; // Maximum number of unacknowledged QoS 1 messages.
 } config;
 
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint32_t crc; // CRC32 of everything after this field.
+    uint8_t version;
+    uint32_t sequence; // Incremented on every save. The valid slot with the highest one is loaded.
+    uint16_t length; // Payload length in bytes.
+} config_record_header_t;
+
+const uint32_t configMagic{0x43474E45}; // "ENGC".
+const uint8_t configVersion{3}; // Fields are only ever appended. Fields missing in an older record keep their defaults.
+const uint8_t configSlots{3};
+const uint8_t configCrcStart{8}; // Magic and CRC are not covered by the CRC.
+alignas(4) uint8_t configRecord[768]{0};
+uint8_t configSlot{0};
+uint32_t configSequence{0};
+const uint16_t configEepromSize{4096}; // A copy of the record is kept outside the filesystem, so uploading a filesystem image keeps the settings.
+const uint8_t configEepromMarker{253}; // In the last EEPROM byte. The record copy is at address 0.
+const uint8_t legacyConfigMarker{254}; // Earlier firmware saved the deviceConfig object itself at address 0.
+
 const String firmware{"1.6"};
 
 const char *mqttUserID{"ESP"};
@@ -72,6 +284,7 @@ uint8_t w5500Mac[6] = {0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED}; // Change it if nece
 
 ZHNetwork myNet;
 AsyncWebServer webServer(80);
+AsyncWebSocket trafficSocket("/traffic");
 
 EthernetClient ethClient;
 WiFiClient wifiClient;
@@ -82,18 +295,372 @@ PubSubClient mqttWifiClient(wifiClient);
 WiFiUDP udpWiFiClient;
 EthernetUDP udpEthClient;
 
-NTPClient ntpWiFiClient(udpWiFiClient, config.ntpHostName.c_str(), config.gmtOffset);
-NTPClient ntpEthClient(udpEthClient, config.ntpHostName.c_str(), config.gmtOffset);
 
-Ticker mqttAvailabilityCheckTimer;
-bool mqttAvailabilityCheckTimerSemaphore{true};
+char gatewayMac[13]{0}; // myNet.getNodeMac() without a String per use.
+
+
+typedef struct
+{
+    uint32_t id{0}; // 0 marks a free entry.
+    uint8_t mac[6]{0};
+    bool isMacFiltered{false};
+    uint16_t typeMask{0xFFFF}; // Bit per ENPT_* value.
+    uint32_t droppedFrames{0};
+} traffic_client_t;
+
+const uint8_t trafficClientsSize{4}; // Further WebSocket connections are closed.
+
+traffic_client_t trafficClients[trafficClientsSize]; // Changed by loop() only.
+uint8_t trafficClientsCount{0};
+uint32_t trafficDroppedCounter{0}; // Frames not sent because a client send queue was full.
+
+#if defined(ESP32)
+const uint8_t trafficEventQueueSize{8}; // WebSocket events from the async_tcp task to loop().
+
+QueueHandle_t trafficEventQueue{nullptr};
+uint32_t trafficEventOverflowCounter{0}; // Written by the async_tcp task only.
+#endif
+
+web_asset_t webAssets[]{ // Gzipped at build time by compress_data.py.
+    {"/index.htm", "text/html", ""},
+    {"/function.js", "application/javascript", ""},
+    {"/style.css", "text/css", ""}};
+
+
+
+typedef struct
+{
+    uint8_t sender[6]{0};
+    uint32_t receivedTime{0};
+    esp_now_payload_data_t data;
+} received_message_t;
+
+const uint8_t receivedQueueSize{16}; // Must be a power of two.
+const uint16_t receivedQueueBudget{5000}; // Maximum time in microseconds spent on received frames per loop iteration.
+
+received_message_t receivedQueue[receivedQueueSize];
+std::atomic<uint8_t> receivedQueueHead{0}; // Written by the consumer (loop) only.
+std::atomic<uint8_t> receivedQueueTail{0}; // Written by the producer (ESP-NOW callback) only.
+uint8_t receivedQueueHighWater{0};
+uint32_t receivedQueueOverflowCounter{0};
+
+typedef struct
+{
+    uint32_t key{0}; // Sender and types. 0 marks an empty entry.
+    uint32_t fingerprint{0}; // Payload of the last frame with this key.
+    uint32_t receivedTime{0};
+} duplicate_entry_t;
+
+const uint8_t duplicateTableSize{64}; // Must be a power of two.
+const uint8_t duplicateMaxProbe{8};
+const uint16_t duplicateWindow{500}; // In milliseconds. Copies of a frame relayed over the mesh arrive well within it.
+// Only a repeat of the last frame with the same sender and types is a duplicate. ON, OFF, ON within the window passes.
+
+duplicate_entry_t duplicateTable[duplicateTableSize]; // Used by the ESP-NOW callback only.
+uint32_t duplicateCounter{0};
+
+typedef struct
+{
+    uint8_t sender[6]{0};
+    uint32_t receivedTime{0};
+    esp_now_payload_data_t data;
+} pending_message_t;
+
+const uint8_t pendingQueueSize{12}; // Frames kept in RAM while MQTT is unavailable.
+const uint16_t pendingSpillLimit{128}; // Frames spilled to LittleFS when the RAM queue is full.
+const uint8_t pendingSpillBatch{4}; // Frames collected before the spill file is written. One open and write per batch.
+const char *pendingSpillFile{"/pending.bin"};
+const uint8_t pendingReplayBatch{2}; // Frames replayed per replay interval after reconnect.
+const uint16_t pendingReplayInterval{50}; // In milliseconds.
+
+pending_message_t pendingQueue[pendingQueueSize];
+uint8_t pendingQueueHead{0};
+uint8_t pendingQueueCount{0};
+uint16_t pendingSpillCount{0}; // Frames in the spill file.
+uint32_t pendingSpillReadOffset{0};
+pending_message_t pendingSpillBuffer[pendingSpillBatch]; // Newer than the spill file, older than the RAM queue.
+uint8_t pendingSpillBufferStart{0};
+uint8_t pendingSpillBufferCount{0};
+uint32_t lastPendingReplayTime{0};
+uint32_t pendingQueuedCounter{0};
+uint32_t pendingDroppedCounter{0};
+uint32_t pendingReplayedCounter{0};
+
+
+
+typedef enum : uint8_t
+{
+    WCS_IDLE, // Waiting for the next scan.
+    WCS_CONNECT,
+    WCS_SCAN,
+    WCS_CONNECTED
+} wifi_connection_state_t;
+
+const uint16_t wifiConnectTimeout{10000}; // In milliseconds. Direct connect attempt before falling back to a scan.
+const uint32_t wifiScanInterval{60000}; // In milliseconds. Scans interrupt ESP-NOW, so a missing or rejecting network is retried rarely.
+
+uint8_t wifiConnectionState{WCS_IDLE};
+uint32_t wifiStateEnterTime{0};
+bool isWifiScanUsed{false}; // The last connection needed a scan because the cached access point was missing or unreachable.
+
+uint32_t bootSetupTime{0}; // Boot phase timestamps in milliseconds since start.
+uint32_t bootWifiTime{0};
+uint32_t bootMqttTime{0};
+uint32_t bootFirstFrameTime{0};
+
+typedef enum : uint8_t
+{
+    MCS_IDLE,
+    MCS_RESOLVE,
+    MCS_CONNECT,
+    MCS_SUBSCRIBE,
+    MCS_ANNOUNCE,
+    MCS_CONNECTED
+} mqtt_connection_state_t;
+
+const uint16_t mqttBufferSize{256}; // Topic of outgoing messages and whole incoming messages. Payloads are streamed.
+#if defined(ESP8266)
+const uint16_t mqttConnectTimeout{250}; // In milliseconds. TCP connect timeout. The connect blocks loop(), a broker on the local network accepts well within it.
+const uint16_t mqttWriteTimeout{1000}; // In milliseconds. WiFi only. The WiFi client uses one timeout for the connect and the writes.
+const uint8_t mqttSocketTimeout{1}; // In seconds. CONNACK timeout, waited for only once the TCP connect succeeded. PubSubClient has no finer resolution.
+#endif
+#if defined(ESP32)
+const uint16_t mqttConnectTimeout{1000}; // In milliseconds. TCP connect timeout.
+const uint8_t mqttSocketTimeout{2}; // In seconds. CONNACK timeout.
+#endif
+const uint16_t mqttMinBackoff{1000}; // In milliseconds.
+const uint32_t mqttMaxBackoff{60000}; // In milliseconds.
+
+const uint16_t mqttPingInterval{5000}; // In milliseconds. Broker round trip measurement in ESP_NOW_DUAL mode.
+const uint16_t mqttPingTimeout{3000}; // In milliseconds. A link without a ping echo is dropped and the other link takes over.
+const uint16_t mqttRttHysteresis{20}; // In milliseconds. The other link must be this much faster to take over.
+
+typedef enum : uint8_t
+{
+    ML_WIFI,
+    ML_LAN,
+    ML_COUNT
+} mqtt_link_index_t;
+
+typedef enum : uint8_t
+{
+    MCR_NONE,
+    MCR_PENDING,
+    MCR_CONNECTED,
+    MCR_FAILED
+} mqtt_connect_result_t;
+
+struct mqtt_link_t
+{
+    mqtt_link_t(PubSubClient *client, Client *network, const char *name, const char *userID) : client(client), network(network), name(name), userID(userID) {}
+    PubSubClient *client;
+    Client *network;
+    const char *name;
+    const char *userID;
+    uint8_t state{MCS_IDLE};
+    uint8_t step{0};
+    uint32_t stateEnterTime{0};
+    uint32_t stateDuration[MCS_CONNECTED]{0}; // Time in milliseconds spent in each state during the last connection attempt.
+    uint32_t connectStartTime{0};
+    uint32_t connectLatency{0};
+    uint32_t nextAttemptTime{0};
+    uint32_t backoff{mqttMinBackoff};
+    uint32_t connectAttemptCounter{0};
+    IPAddress hostIP;
+    bool isHostResolved{false};
+    host_resolver_t resolver;
+#if defined(ESP32)
+    std::atomic<uint8_t> connectResult{MCR_NONE}; // Written by the MQTT connect task.
+#endif
+    bool isPingPending{false};
+    uint32_t pingSentTime{0};
+    uint16_t rtt{0}; // Smoothed broker round trip in milliseconds. 0 until the first echo.
+    uint32_t pingTimeoutCounter{0};
+};
+
+mqtt_link_t mqttLinks[ML_COUNT]{{&mqttWifiClient, &wifiClient, "WiFi", "ESP-WIFI"}, {&mqttEthClient, &ethClient, "LAN", "ESP-LAN"}}; // Client IDs are used in ESP_NOW_DUAL mode only, both links are connected at the same time.
+uint8_t mqttActiveLink{ML_WIFI}; // The link used for publishing.
+
+typedef struct
+{
+    uint32_t hash{0};
+    uint32_t receivedTime{0};
+    uint8_t link{ML_COUNT};
+} mqtt_command_entry_t;
+
+const uint8_t mqttCommandTableSize{8};
+const uint16_t mqttCommandWindow{5000}; // In milliseconds. The copy of a command on the other link arrives well within it.
+
+mqtt_command_entry_t mqttCommandTable[mqttCommandTableSize]; // Commands received on one link only so far. ESP_NOW_DUAL mode only.
+uint32_t mqttCommandDuplicateCounter{0};
+uint32_t mqttLinkSwitchCounter{0};
 bool isMqttAvailable{false};
-void mqttAvailabilityCheckTimerCallback(void);
+#if defined(ESP32)
+const uint16_t mqttConnectTaskStackSize{4096}; // In bytes.
+
+QueueHandle_t mqttConnectQueue{nullptr}; // Links to connect. PubSubClient::connect() blocks for the TCP connect and the CONNACK. While the LAN link connects, loop() leaves the W5500 alone.
+TaskHandle_t mqttConnectTaskHandle{nullptr};
+#endif
+
+const uint16_t hostResolveTimeout{2000}; // In milliseconds.
+const uint16_t dnsPort{53};
+uint8_t dnsBuffer[512]{0}; // Query and response of the LAN resolver. Used by loop() only.
+
+#if defined(ESP8266)
+const uint16_t mqttInflightBufferSize{3072}; // Whole PUBLISH packets kept for retransmission.
+#endif
+#if defined(ESP32)
+const uint16_t mqttInflightBufferSize{8192}; // Whole PUBLISH packets kept for retransmission.
+#endif
+const uint16_t mqttWindowReserve{1024}; // Free buffer needed before the next ESP-NOW frame is processed. A frame may publish several messages.
+
+uint8_t mqttInflightBuffer[mqttInflightBufferSize]{0};
+mqtt_qos1_t mqttQos1{mqttInflightBuffer, mqttInflightBufferSize};
+uint32_t mqttQos0Counter{0}; // Published at QoS 0 because the window or the buffer was full.
+
+typedef enum : uint8_t
+{
+    NS_IDLE,
+    NS_RESOLVE,
+    NS_REQUEST,
+    NS_WAIT
+} ntp_state_t;
+
+const uint16_t ntpLocalPort{2390};
+const uint8_t ntpPacketSize{48};
+const uint32_t ntpEpochOffset{2208988800UL}; // Seconds from 1900 (NTP era 0) to 1970 (Unix epoch).
+const uint16_t ntpResponseTimeout{1000}; // In milliseconds.
+const uint32_t ntpSyncInterval{900000}; // In milliseconds. The local clock is drift corrected between syncs.
+const uint32_t ntpRetryInterval{10000}; // In milliseconds. Doubled after each failure up to the sync interval.
+const uint32_t ntpMinDriftInterval{60000}; // In milliseconds. Shorter sync intervals are too noisy to estimate drift.
+const int32_t ntpMaxDrift{500}; // In ppm. Larger values are treated as a clock step, not drift.
+const uint8_t ntpMaxFailures{3}; // The host name is resolved again after this number of consecutive failures.
+
+uint8_t ntpState{NS_IDLE};
+uint32_t ntpRequestTime{0};
+uint32_t ntpNextRequestTime{0};
+uint32_t ntpRetryBackoff{ntpRetryInterval};
+IPAddress ntpHostIP;
+bool isNtpHostResolved{false};
+host_resolver_t ntpResolver;
+bool isNtpSynced{false};
+uint64_t ntpSyncEpoch{0}; // UTC time of the last sync in milliseconds since 1970.
+uint32_t ntpSyncTime{0}; // millis() at the last sync.
+int32_t ntpDrift{0}; // Local clock drift in ppm, positive when millis() runs slow.
+int32_t ntpLastOffset{0}; // Correction applied by the last sync in milliseconds.
+uint16_t ntpLastRoundTrip{0};
+uint8_t ntpConsecutiveFailures{0};
+uint32_t ntpFailureCounter{0};
+
+
+const uint8_t metricsPayloadTypes{16}; // Covers all ENPT_* values.
+const uint8_t metricsHistogramBuckets{16}; // Bucket N counts values from 2^N to 2^(N+1) - 1.
+
+struct gatewayMetrics
+{
+    uint32_t espnowRx[metricsPayloadTypes]{0};
+    uint32_t espnowTx[metricsPayloadTypes]{0};
+    uint32_t mqttTx{0};
+    uint32_t mqttTxFailed{0};
+    uint32_t mqttMaxPacket{0}; // Largest published topic + payload in bytes.
+    uint32_t loopTime[metricsHistogramBuckets]{0}; // In microseconds.
+    uint32_t latency[metricsHistogramBuckets]{0}; // ESP-NOW receive to MQTT publish in milliseconds.
+    uint32_t minFreeHeap{UINT32_MAX};
+    uint32_t minMaxFreeBlock{UINT32_MAX};
+    uint32_t lastHeapCheckTime{0};
+    uint32_t lastRxTotal{0};
+    uint32_t lastPublishTime{0};
+#if defined(ESP32)
+    uint32_t loopBusyTime{0}; // In microseconds.
+    uint32_t lastLoopBusyTime{0};
+    uint32_t lastRadioBusyTime{0};
+#endif
+} metrics;
+
+#if defined(ESP32)
+typedef struct
+{
+    esp_now_payload_data_t data;
+    uint8_t target[6]{0};
+    bool isBroadcast{false};
+    uint8_t slot{downlinkNoSlot}; // Downlink queue entry. Delivery confirmation is requested if set.
+    uint8_t generation{0};
+} radio_message_t;
+
+typedef enum : uint8_t
+{
+    RRK_SENT, // Message ID assigned to a downlink queue entry.
+    RRK_CONFIRMED,
+    RRK_REJECTED
+} radio_result_kind_t;
+
+typedef struct
+{
+    uint8_t kind{RRK_SENT};
+    uint8_t slot{downlinkNoSlot}; // For RRK_SENT only.
+    uint8_t generation{0}; // For RRK_SENT only.
+    uint16_t messageId{0};
+} radio_result_t;
+
+const uint8_t radioQueueSize{8}; // Outgoing ESP-NOW messages from loop() to the radio task.
+const uint8_t radioResultQueueSize{16}; // Message IDs and delivery confirmations from the radio task to loop().
+const uint16_t radioTaskStackSize{4096}; // In bytes.
+const BaseType_t radioTaskCore{0}; // Same core as the WiFi stack. loop() runs on the other one.
+
+QueueHandle_t radioQueue{nullptr};
+QueueHandle_t radioResultQueue{nullptr};
+TaskHandle_t radioTaskHandle{nullptr};
+TaskHandle_t loopTaskHandle{nullptr};
+BaseType_t loopTaskCore{1};
+volatile uint32_t radioTaskBusyTime{0}; // In microseconds. Written by the radio task only.
+uint32_t radioQueueOverflowCounter{0};
+volatile uint32_t radioResultOverflowCounter{0}; // Written by the radio task only.
+#endif
+
+
+
+const uint8_t captureSegmentsCount{4}; // Ring of segment files. The oldest one is overwritten.
+const uint16_t captureSegmentSize{16384}; // In bytes including the header.
+const uint16_t captureFlushInterval{5000}; // In milliseconds. Records are written to flash in batches.
+const uint8_t captureReplayBatch{16}; // Records replayed per loop iteration.
+
+uint8_t captureBuffer[512]{0};
+uint16_t captureBufferLength{0};
+bool isCaptureRunning{false};
+volatile uint8_t captureCommand{CC_NONE}; // Set by the web server, handled in loop().
+uint8_t captureSegment{0};
+uint32_t captureSequence{0};
+uint32_t captureSegmentLength{0};
+uint32_t captureLastFlushTime{0};
+uint32_t captureFramesCounter{0};
+
+File captureReplayFile;
+uint8_t captureReplayOrder[captureSegmentsCount]{0};
+uint8_t captureReplayOrderCount{0};
+uint8_t captureReplayIndex{0};
+bool isCaptureReplayRunning{false};
+bool isCaptureReplayOriginalSpeed{false};
+bool isCaptureRecordPending{false};
+capture_record_t captureReplayRecord;
+char captureReplayMessage[sizeof(esp_now_payload_data_t::message)]{0};
+uint32_t captureReplayStartTime{0};
+uint32_t captureReplayFirstTime{0};
+uint32_t captureReplayFrames{0};
+uint32_t captureReplayBusyTime{0}; // In microseconds spent in the message handling.
+uint32_t captureReplayDuration{0}; // In milliseconds.
 
 Ticker keepAliveMessageTimer;
 bool keepAliveMessageTimerSemaphore{true};
 void keepAliveMessageTimerCallback(void);
 
+Ticker metricsMessageTimer;
+bool metricsMessageTimerSemaphore{false};
+void metricsMessageTimerCallback(void);
+
+Ticker availabilityCheckTimer;
+bool availabilityCheckTimerSemaphore{false};
+void availabilityCheckTimerCallback(void);
+
 Ticker attributesMessageTimer;
 bool attributesMessageTimerSemaphore{true};
 void attributesMessageTimerCallback(void);
@@ -109,13 +676,15 @@ void setup()
 
     loadConfig();
 
-    if (config.workMode == ESP_NOW_LAN)
+    LittleFS.remove(pendingSpillFile);
+
+    if (config.workMode == ESP_NOW_LAN || config.workMode == ESP_NOW_DUAL)
     {
         Ethernet.init(5);
         Ethernet.begin(w5500Mac);
     }
 
-    if (config.workMode == ESP_NOW_WIFI)
+    if (config.workMode == ESP_NOW_WIFI || config.workMode == ESP_NOW_DUAL)
     {
 #if defined(ESP8266)
         WiFi.setSleepMode(WIFI_NONE_SLEEP);
@@ -129,12 +698,14 @@ void setup()
     }
 
     myNet.begin(config.espnowNetName.c_str(), true);
+    strncpy(gatewayMac, myNet.getNodeMac().c_str(), sizeof(gatewayMac) - 1);
 
     if (config.workMode)
     {
         // myNet.setCryptKey("VERY_LONG_CRYPT_KEY"); // If encryption is used, the key must be set same of all another ESP-NOW devices in network.
         myNet.setOnBroadcastReceivingCallback(onEspnowMessage);
         myNet.setOnUnicastReceivingCallback(onEspnowMessage);
+        myNet.setOnConfirmReceivingCallback(onEspnowConfirm);
     }
 
 #if defined(ESP8266)
@@ -144,347 +715,362 @@ void setup()
     WiFi.softAP(("ESP-NOW gateway " + String(ESP.getEfuseMac(), HEX)).c_str(), "12345678");
 #endif
 
-    if (config.workMode == ESP_NOW_WIFI)
+    if (config.workMode == ESP_NOW_WIFI || config.workMode == ESP_NOW_DUAL)
     {
-        uint8_t scan = WiFi.scanNetworks(false, false);
-        String name;
-        int32_t rssi;
-        uint8_t encryption;
-        uint8_t *bssid;
-        int32_t channel;
-        bool hidden;
-        for (int8_t i = 0; i < scan; i++)
+        if (config.wifiChannel)
         {
-#if defined(ESP8266)
-            WiFi.getNetworkInfo(i, name, encryption, rssi, bssid, channel, hidden);
-#endif
-#if defined(ESP32)
-            WiFi.getNetworkInfo(i, name, encryption, rssi, bssid, channel);
-#endif
-            if (name == config.ssid)
-                WiFi.begin(config.ssid.c_str(), config.password.c_str());
+            WiFi.begin(config.ssid.c_str(), config.password.c_str(), config.wifiChannel, config.wifiBssid);
+            setWifiConnectionState(WCS_CONNECT);
+        }
+        else
+        {
+            WiFi.scanNetworks(true, false);
+            setWifiConnectionState(WCS_SCAN);
         }
     }
 
-    if (config.workMode == ESP_NOW_WIFI)
+    if (isMqttLinkEnabled(ML_WIFI))
     {
-        ntpWiFiClient.begin();
-        mqttWifiClient.setBufferSize(2048);
+        udpWiFiClient.begin(ntpLocalPort);
+#if defined(ESP8266)
+        wifiClient.setTimeout(mqttWriteTimeout);
+#endif
+#if defined(ESP32)
+        wifiClient.setTimeout((mqttConnectTimeout + 999) / 1000); // In seconds on ESP32. Also used as the connect timeout.
+#endif
+        mqttWifiClient.setBufferSize(mqttBufferSize);
+        mqttWifiClient.setSocketTimeout(mqttSocketTimeout);
         mqttWifiClient.setServer(config.mqttHostName.c_str(), config.mqttHostPort);
-        mqttWifiClient.setCallback(onMqttMessage);
+        mqttWifiClient.setCallback([](char *topic, byte *payload, unsigned int length)
+                                   { onMqttLinkMessage(ML_WIFI, topic, payload, length); });
     }
 
-    if (config.workMode == ESP_NOW_LAN)
+    if (isMqttLinkEnabled(ML_LAN))
     {
-        ntpEthClient.begin();
-        mqttEthClient.setBufferSize(2048);
+        udpEthClient.begin(ntpLocalPort);
+        ethClient.setConnectionTimeout(mqttConnectTimeout);
+        mqttEthClient.setBufferSize(mqttBufferSize);
+        mqttEthClient.setSocketTimeout(mqttSocketTimeout);
         mqttEthClient.setServer(config.mqttHostName.c_str(), config.mqttHostPort);
-        mqttEthClient.setCallback(onMqttMessage);
+        mqttEthClient.setCallback([](char *topic, byte *payload, unsigned int length)
+                                  { onMqttLinkMessage(ML_LAN, topic, payload, length); });
     }
 
+    mqttActiveLink = config.workMode == ESP_NOW_WIFI ? ML_WIFI : ML_LAN;
+
     setupWebServer();
 
     ArduinoOTA.begin();
 
     keepAliveMessageTimer.attach(10, keepAliveMessageTimerCallback);
-    mqttAvailabilityCheckTimer.attach(5, mqttAvailabilityCheckTimerCallback);
     attributesMessageTimer.attach(60, attributesMessageTimerCallback);
+    metricsMessageTimer.attach(60, metricsMessageTimerCallback);
+    availabilityCheckTimer.attach(5, availabilityCheckTimerCallback);
+
+#if defined(ESP32)
+    loopTaskHandle = xTaskGetCurrentTaskHandle();
+    loopTaskCore = xPortGetCoreID();
+    radioQueue = xQueueCreate(radioQueueSize, sizeof(radio_message_t));
+    radioResultQueue = xQueueCreate(radioResultQueueSize, sizeof(radio_result_t));
+    xTaskCreatePinnedToCore(radioTask, "radio", radioTaskStackSize, nullptr, 2, &radioTaskHandle, radioTaskCore);
+    mqttConnectQueue = xQueueCreate(ML_COUNT, sizeof(uint8_t));
+    xTaskCreatePinnedToCore(mqttConnectTask, "mqtt connect", mqttConnectTaskStackSize, nullptr, 1, &mqttConnectTaskHandle, radioTaskCore);
+#endif
+
+    bootSetupTime = millis();
 }
 
 void loop()
 {
-    if (mqttAvailabilityCheckTimerSemaphore)
-        checkMqttAvailability();
+    uint32_t loopStartTime = micros();
+    if ((config.workMode == ESP_NOW_WIFI || config.workMode == ESP_NOW_DUAL) && wifiConnectionState != WCS_CONNECTED)
+        checkWifiConnection();
+    for (uint8_t i{0}; i < ML_COUNT; ++i)
+        if (isMqttLinkEnabled(i))
+            checkMqttAvailability(i);
+    if (config.workMode)
+        checkNtpTime();
     if (keepAliveMessageTimerSemaphore)
         sendKeepAliveMessage();
     if (attributesMessageTimerSemaphore)
         sendAttributesMessage();
-    if (config.workMode == ESP_NOW_WIFI)
-        mqttWifiClient.loop();
-    if (config.workMode == ESP_NOW_LAN)
-        mqttEthClient.loop();
+    if (metricsMessageTimerSemaphore)
+        sendMetricsMessage();
+    if (availabilityCheckTimerSemaphore)
+        checkDeviceAvailability();
+    if (captureCommand)
+        handleCaptureCommand();
+    if (isCaptureRunning && captureBufferLength && millis() - captureLastFlushTime >= captureFlushInterval)
+        flushCapture();
+    if (isCaptureReplayRunning)
+        replayCaptureFrames();
+    for (uint8_t i{0}; i < ML_COUNT; ++i)
+        if (isMqttLinkEnabled(i) && mqttLinks[i].state >= MCS_SUBSCRIBE && readMqttAcks(i)) // Not while the connect task uses the client.
+            mqttLinks[i].client->loop();
+    if (isMqttAvailable && mqttQos1.count)
+        retransmitMqttInflight();
+    if (isMqttAvailable && (pendingQueueCount || pendingSpillCount || pendingSpillBufferCount))
+        replayPendingMessages();
+    if (isMqttAvailable && coalescePendingCount)
+        flushCoalescedStates();
+#if defined(ESP8266)
     myNet.maintenance();
+#endif
+    handleReceivedMessages();
+#if defined(ESP32)
+    handleRadioResults();
+    handleTrafficEvents();
+#endif
+    if (downlinkQueueCount)
+        processDownlinkQueue();
     ArduinoOTA.handle();
+    updateHeapMetrics();
+    addHistogramValue(metrics.loopTime, micros() - loopStartTime);
+#if defined(ESP32)
+    metrics.loopBusyTime += micros() - loopStartTime;
+#endif
 }
 
 void onEspnowMessage(const char *data, const uint8_t *sender)
 {
-    if (!isMqttAvailable)
+    if (isDuplicateMessage(*(const esp_now_payload_data_t *)data, sender))
+    {
+        ++duplicateCounter;
         return;
-    esp_now_payload_data_t incomingData;
-    memcpy(&incomingData, data, sizeof(esp_now_payload_data_t));
-    if (incomingData.payloadsType == ENPT_ATTRIBUTES)
-        mqttPublish((config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/" + getValueName(incomingData.payloadsType)).c_str(), incomingData.message, true);
-    if (incomingData.payloadsType == ENPT_KEEP_ALIVE)
-        mqttPublish((config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/" + getValueName(incomingData.payloadsType)).c_str(), "online", true);
-    if (incomingData.payloadsType == ENPT_STATE)
-        mqttPublish((config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/" + getValueName(incomingData.payloadsType)).c_str(), incomingData.message, true);
-    if (incomingData.payloadsType == ENPT_CONFIG)
-    {
-        if (incomingData.deviceType == ENDT_SWITCH)
-        {
-            esp_now_payload_data_t configData;
-            memcpy(&configData.message, &incomingData.message, sizeof(esp_now_payload_data_t::message));
-            DynamicJsonDocument json(sizeof(esp_now_payload_data_t::message));
-            deserializeJson(json, configData.message);
-            uint8_t unit = json[MCMT_DEVICE_UNIT].as<uint8_t>();
-            DynamicJsonDocument jsonConfig(2048); // Same as PubSubClient buffer size.
-            jsonConfig["platform"] = "mqtt";
-            jsonConfig["name"] = json[MCMT_DEVICE_NAME];
-            jsonConfig["unique_id"] = myNet.macToString(sender) + "-" + unit;
-            jsonConfig["device_class"] = getValueName(json[MCMT_DEVICE_CLASS].as<ha_switch_device_class_t>());
-            jsonConfig["state_topic"] = config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/state";
-            jsonConfig["value_template"] = "{{ value_json." + json[MCMT_VALUE_TEMPLATE].as<String>() + " }}";
-            jsonConfig["command_topic"] = config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/set";
-            jsonConfig["json_attributes_topic"] = config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/attributes";
-            jsonConfig["availability_topic"] = config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/status";
-            if (json[MCMT_PAYLOAD_ON])
-                jsonConfig["payload_on"] = json[MCMT_PAYLOAD_ON];
-            if (json[MCMT_PAYLOAD_OFF])
-                jsonConfig["payload_off"] = json[MCMT_PAYLOAD_OFF];
-            jsonConfig["optimistic"] = "false";
-            jsonConfig["retain"] = "true";
-            char buffer[2048]{0};
-            serializeJsonPretty(jsonConfig, buffer);
-            mqttPublish((config.topicPrefix + "/" + getValueName(json[MCMT_COMPONENT_TYPE].as<ha_component_type_t>()) + "/" + myNet.macToString(sender) + "-" + unit + "/config").c_str(), buffer, true);
-        }
-        if (incomingData.deviceType == ENDT_LED)
-        {
-            esp_now_payload_data_t configData;
-            memcpy(&configData.message, &incomingData.message, sizeof(esp_now_payload_data_t::message));
-            DynamicJsonDocument json(sizeof(esp_now_payload_data_t::message));
-            deserializeJson(json, configData.message);
-            uint8_t unit = json[MCMT_DEVICE_UNIT].as<uint8_t>();
-            esp_now_led_type_t ledClass = json[MCMT_DEVICE_CLASS];
-            DynamicJsonDocument jsonConfig(2048); // Same as PubSubClient buffer size.
-            jsonConfig["platform"] = "mqtt";
-            jsonConfig["name"] = json[MCMT_DEVICE_NAME];
-            jsonConfig["unique_id"] = myNet.macToString(sender) + "-" + unit;
-            jsonConfig["state_topic"] = config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/state";
-            jsonConfig["state_value_template"] = "{{ value_json.state }}";
-            jsonConfig["command_topic"] = config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/set";
-            jsonConfig["brightness_state_topic"] = config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/state";
-            jsonConfig["brightness_value_template"] = "{{ value_json.brightness }}";
-            jsonConfig["brightness_command_topic"] = config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/brightness";
-            if (ledClass == ENLT_RGB || ledClass == ENLT_RGBW || ledClass == ENLT_RGBWW)
-            {
-                jsonConfig["rgb_state_topic"] = config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/state";
-                jsonConfig["rgb_value_template"] = "{{ value_json.rgb | join(',') }}";
-                jsonConfig["rgb_command_topic"] = config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/rgb";
-            }
-            if (ledClass == ENLT_WW || ledClass == ENLT_RGBWW)
-            {
-                jsonConfig["color_temp_state_topic"] = config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/state";
-                jsonConfig["color_temp_value_template"] = "{{ value_json.temperature }}";
-                jsonConfig["color_temp_command_topic"] = config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/temperature";
-            }
-            jsonConfig["json_attributes_topic"] = config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/attributes";
-            jsonConfig["availability_topic"] = config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/status";
-            if (json[MCMT_PAYLOAD_ON])
-                jsonConfig["payload_on"] = json[MCMT_PAYLOAD_ON];
-            if (json[MCMT_PAYLOAD_OFF])
-                jsonConfig["payload_off"] = json[MCMT_PAYLOAD_OFF];
-            jsonConfig["optimistic"] = "false";
-            jsonConfig["retain"] = "true";
-            char buffer[2048]{0};
-            serializeJsonPretty(jsonConfig, buffer);
-            mqttPublish((config.topicPrefix + "/" + getValueName(json[MCMT_COMPONENT_TYPE].as<ha_component_type_t>()) + "/" + myNet.macToString(sender) + "-" + unit + "/config").c_str(), buffer, true);
-        }
-        if (incomingData.deviceType == ENDT_SENSOR)
-        {
-            esp_now_payload_data_t configData;
-            memcpy(&configData.message, &incomingData.message, sizeof(esp_now_payload_data_t::message));
-            DynamicJsonDocument json(sizeof(esp_now_payload_data_t::message));
-            deserializeJson(json, configData.message);
-            uint8_t unit = json[MCMT_DEVICE_UNIT].as<uint8_t>();
-            ha_component_type_t type = json[MCMT_COMPONENT_TYPE].as<ha_component_type_t>();
-            DynamicJsonDocument jsonConfig(2048); // Same as PubSubClient buffer size.
-            jsonConfig["platform"] = "mqtt";
-            jsonConfig["name"] = json[MCMT_DEVICE_NAME];
-            jsonConfig["unique_id"] = myNet.macToString(sender) + "-" + unit;
-            jsonConfig["state_topic"] = config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/state";
-            jsonConfig["value_template"] = "{{ value_json." + json[MCMT_VALUE_TEMPLATE].as<String>() + " }}";
-            jsonConfig["json_attributes_topic"] = config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/attributes";
-            jsonConfig["force_update"] = "true";
-            jsonConfig["retain"] = "true";
-            if (type == HACT_SENSOR)
-            {
-                jsonConfig["device_class"] = getValueName(json[MCMT_DEVICE_CLASS].as<ha_sensor_device_class_t>());
-                jsonConfig["unit_of_measurement"] = json[MCMT_UNIT_OF_MEASUREMENT];
-            }
-            if (type == HACT_BINARY_SENSOR)
-                jsonConfig["device_class"] = getValueName(json[MCMT_DEVICE_CLASS].as<ha_binary_sensor_device_class_t>());
-            if (json[MCMT_EXPIRE_AFTER])
-                jsonConfig["expire_after"] = json[MCMT_EXPIRE_AFTER];
-            if (json[MCMT_OFF_DELAY])
-                jsonConfig["off_delay"] = json[MCMT_OFF_DELAY];
-            if (json[MCMT_PAYLOAD_ON])
-                jsonConfig["payload_on"] = json[MCMT_PAYLOAD_ON];
-            if (json[MCMT_PAYLOAD_OFF])
-                jsonConfig["payload_off"] = json[MCMT_PAYLOAD_OFF];
-            char buffer[2048]{0};
-            serializeJsonPretty(jsonConfig, buffer);
-            mqttPublish((config.topicPrefix + "/" + getValueName(type) + "/" + myNet.macToString(sender) + "-" + unit + "/config").c_str(), buffer, true);
-        }
-        if (incomingData.deviceType == ENDT_RF_SENSOR)
-        {
-            esp_now_payload_data_t configData;
-            memcpy(&configData.message, &incomingData.message, sizeof(esp_now_payload_data_t::message));
-            DynamicJsonDocument json(sizeof(esp_now_payload_data_t::message));
-            deserializeJson(json, configData.message);
-            uint8_t unit = json[MCMT_DEVICE_UNIT].as<uint8_t>();
-            ha_component_type_t haComponentType = json[MCMT_COMPONENT_TYPE].as<ha_component_type_t>();
-            rf_sensor_type_t rfSensorType = json[MCMT_RF_SENSOR_TYPE].as<rf_sensor_type_t>();
-            uint16_t rfSensorId = json[MCMT_RF_SENSOR_ID].as<uint16_t>();
-            String valueTemplate = json[MCMT_VALUE_TEMPLATE].as<String>();
-            DynamicJsonDocument jsonConfig(2048); // Same as PubSubClient buffer size.
-            jsonConfig["platform"] = "mqtt";
-            jsonConfig["name"] = getValueName(rfSensorType) + " " + rfSensorId + " " + valueTemplate;
-            jsonConfig["unique_id"] = String(rfSensorId) + "-" + unit;
-            jsonConfig["state_topic"] = config.topicPrefix + "/rf_sensor/" + getValueName(rfSensorType) + "/" + rfSensorId + "/state";
-            jsonConfig["value_template"] = "{{ value_json." + valueTemplate + " }}";
-            jsonConfig["force_update"] = "true";
-            jsonConfig["retain"] = "true";
-            if (haComponentType == HACT_SENSOR)
-            {
-                jsonConfig["device_class"] = getValueName(json[MCMT_DEVICE_CLASS].as<ha_sensor_device_class_t>());
-                jsonConfig["unit_of_measurement"] = json[MCMT_UNIT_OF_MEASUREMENT];
-            }
-            if (haComponentType == HACT_BINARY_SENSOR)
-                jsonConfig["device_class"] = getValueName(json[MCMT_DEVICE_CLASS].as<ha_binary_sensor_device_class_t>());
-            if (json[MCMT_EXPIRE_AFTER])
-                jsonConfig["expire_after"] = json[MCMT_EXPIRE_AFTER];
-            if (json[MCMT_OFF_DELAY])
-                jsonConfig["off_delay"] = json[MCMT_OFF_DELAY];
-            if (json[MCMT_PAYLOAD_ON])
-                jsonConfig["payload_on"] = json[MCMT_PAYLOAD_ON];
-            if (json[MCMT_PAYLOAD_OFF])
-                jsonConfig["payload_off"] = json[MCMT_PAYLOAD_OFF];
-            char buffer[2048]{0};
-            serializeJsonPretty(jsonConfig, buffer);
-            mqttPublish((config.topicPrefix + "/" + getValueName(haComponentType) + "/" + rfSensorId + "-" + unit + "/config").c_str(), buffer, true);
-        }
-        if (incomingData.deviceType == ENDT_RF_GATEWAY)
-        {
-            esp_now_payload_data_t configData;
-            memcpy(&configData.message, &incomingData.message, sizeof(esp_now_payload_data_t::message));
-            DynamicJsonDocument json(sizeof(esp_now_payload_data_t::message));
-            deserializeJson(json, configData.message);
-            uint8_t unit = json[MCMT_DEVICE_UNIT].as<uint8_t>();
-            DynamicJsonDocument jsonConfig(2048); // Same as PubSubClient buffer size.
-            jsonConfig["platform"] = "mqtt";
-            jsonConfig["name"] = json[MCMT_DEVICE_NAME];
-            jsonConfig["unique_id"] = myNet.macToString(sender) + "-" + unit;
-            jsonConfig["device_class"] = getValueName(json[MCMT_DEVICE_CLASS].as<ha_binary_sensor_device_class_t>());
-            jsonConfig["state_topic"] = config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/status";
-            jsonConfig["json_attributes_topic"] = config.topicPrefix + "/" + getValueName(incomingData.deviceType) + "/" + myNet.macToString(sender) + "/attributes";
-            jsonConfig["payload_on"] = json[MCMT_PAYLOAD_ON];
-            jsonConfig["expire_after"] = json[MCMT_EXPIRE_AFTER];
-            jsonConfig["force_update"] = "true";
-            jsonConfig["retain"] = "true";
-            char buffer[2048]{0};
-            serializeJsonPretty(jsonConfig, buffer);
-            mqttPublish((config.topicPrefix + "/" + getValueName(json[MCMT_COMPONENT_TYPE].as<ha_component_type_t>()) + "/" + myNet.macToString(sender) + "-" + unit + "/config").c_str(), buffer, true);
-        }
-    }
-    if (incomingData.payloadsType == ENPT_FORWARD)
-    {
-        esp_now_payload_data_t forwardData;
-        memcpy(&forwardData.message, &incomingData.message, sizeof(esp_now_payload_data_t::message));
-        DynamicJsonDocument json(sizeof(esp_now_payload_data_t::message));
-        deserializeJson(json, forwardData.message);
-        if (incomingData.deviceType == ENDT_RF_GATEWAY)
-            mqttPublish((config.topicPrefix + "/rf_sensor/" + getValueName(json["type"].as<rf_sensor_type_t>()) + "/" + json["id"].as<uint16_t>() + "/state").c_str(), incomingData.message, false);
-    }
-}
-
-void onMqttMessage(char *topic, byte *payload, unsigned int length)
-{
-    String mac = getValue(String(topic).substring(0, String(topic).length()), '/', 2);
-    String message;
-    bool flag{false};
-    for (uint16_t i = 0; i < length; ++i)
-    {
-        message += (char)payload[i];
     }
-    esp_now_payload_data_t outgoingData;
-    outgoingData.deviceType = ENDT_GATEWAY;
-    outgoingData.payloadsType = ENPT_SET;
-    DynamicJsonDocument json(sizeof(esp_now_payload_data_t::message));
-    if (message == "update" || message == "restart")
+    uint8_t tail = receivedQueueTail.load(std::memory_order_relaxed);
+    uint8_t used = tail - receivedQueueHead.load(std::memory_order_acquire);
+    if (used >= receivedQueueSize)
+    {
+        ++receivedQueueOverflowCounter;
+        return;
+    }
+    received_message_t &received = receivedQueue[tail % receivedQueueSize];
+    memcpy(received.sender, sender, 6);
+    memcpy(&received.data, data, sizeof(esp_now_payload_data_t));
+    received.receivedTime = millis();
+    receivedQueueTail.store(tail + 1, std::memory_order_release);
+    if (used + 1 > receivedQueueHighWater)
+        receivedQueueHighWater = used + 1;
+}
+
+void handleReceivedMessages()
+{
+    uint32_t startTime = micros();
+    uint8_t head = receivedQueueHead.load(std::memory_order_relaxed);
+    while (head != receivedQueueTail.load(std::memory_order_acquire))
+    {
+        received_message_t &received = receivedQueue[head % receivedQueueSize];
+        updateDeviceRegistry(received.data, received.sender);
+        if (isCaptureRunning)
+            captureFrame(CD_RX, received.data, received.sender);
+        if (received.data.payloadsType < metricsPayloadTypes)
+            ++metrics.espnowRx[received.data.payloadsType];
+        if (!isMqttAvailable || pendingQueueCount || pendingSpillCount || pendingSpillBufferCount || !isMqttWindowOpen())
+            queuePendingMessage(received.data, received.sender, received.receivedTime);
+        else
+        {
+            processEspnowMessage(received.data, received.sender, received.receivedTime);
+            if (!bootFirstFrameTime)
+                bootFirstFrameTime = millis();
+            if (trafficClientsCount)
+                sendTrafficFrame("RX", received.data, received.sender, millis() - received.receivedTime);
+        }
+        receivedQueueHead.store(++head, std::memory_order_release);
+        if (micros() - startTime >= receivedQueueBudget)
+            break;
+    }
+}
+
+bool isDuplicateMessage(const esp_now_payload_data_t &incomingData, const uint8_t *sender)
+{
+    uint32_t key{2166136261}; // FNV-1a over sender and types.
+    for (uint8_t i{0}; i < 6; ++i)
+        key = (key ^ sender[i]) * 16777619;
+    key = (key ^ incomingData.deviceType) * 16777619;
+    key = (key ^ incomingData.payloadsType) * 16777619;
+    if (!key)
+        key = 1;
+    uint32_t fingerprint{key}; // Continued over the message.
+    uint8_t length = getPayloadLength(incomingData);
+    for (uint8_t i{0}; i < length; ++i)
+        fingerprint = (fingerprint ^ (uint8_t)incomingData.message[i]) * 16777619;
+    uint32_t now = millis();
+    duplicate_entry_t *entry{nullptr};
+    duplicate_entry_t *oldest{nullptr};
+    for (uint8_t i{0}; i < duplicateMaxProbe; ++i)
+    {
+        duplicate_entry_t &candidate = duplicateTable[(key + i) & (duplicateTableSize - 1)];
+        if (candidate.key == key)
+        {
+            entry = &candidate;
+            break;
+        }
+        if (!candidate.key && !entry)
+            entry = &candidate;
+        if (!oldest || (int32_t)(candidate.receivedTime - oldest->receivedTime) < 0)
+            oldest = &candidate;
+    }
+    if (!entry)
+        entry = oldest;
+    if (entry->key == key && entry->fingerprint == fingerprint && now - entry->receivedTime < duplicateWindow)
+        return true;
+    entry->key = key;
+    entry->fingerprint = fingerprint;
+    entry->receivedTime = now;
+    return false;
+}
+
+void onMqttLinkMessage(const uint8_t link, char *topic, byte *payload, unsigned int length)
+{
+    const char *ping = strstr(topic, "/ping/");
+    if (ping)
     {
-        if (mac == myNet.getNodeMac() && message == "restart")
-            ESP.restart();
-        flag = true;
+        if (!strcmp(ping + 6, mqttLinks[link].name))
+            onMqttPing(link);
+        return;
     }
-    if (String(topic) == config.topicPrefix + "/espnow_switch/" + mac + "/set" || String(topic) == config.topicPrefix + "/espnow_led/" + mac + "/set")
+    if (config.workMode == ESP_NOW_DUAL && isDuplicateMqttCommand(link, topic, payload, length))
+        return;
+    onMqttMessage(topic, payload, length);
+}
+
+bool isDuplicateMqttCommand(const uint8_t link, const char *topic, const byte *payload, const unsigned int length)
+{
+    // Both links are subscribed, so every command arrives twice. The first copy is used, whichever link brings it.
+    uint32_t hash = getHash(topic);
+    for (unsigned int i{0}; i < length; ++i)
+        hash = (hash ^ payload[i]) * 16777619; // FNV-1a, continued over the payload.
+    uint32_t now = millis();
+    mqtt_command_entry_t *oldest{&mqttCommandTable[0]};
+    for (mqtt_command_entry_t &entry : mqttCommandTable)
     {
-        flag = true;
-        json["set"] = message;
+        if (entry.link != ML_COUNT && now - entry.receivedTime >= mqttCommandWindow)
+            entry.link = ML_COUNT;
+        if (entry.link != ML_COUNT && entry.link != link && entry.hash == hash) // The copy of a command taken from the other link.
+        {
+            entry.link = ML_COUNT;
+            ++mqttCommandDuplicateCounter;
+            return true;
+        }
+        if (oldest->link != ML_COUNT && (entry.link == ML_COUNT || now - entry.receivedTime > now - oldest->receivedTime))
+            oldest = &entry;
     }
-    if (String(topic) == config.topicPrefix + "/espnow_led/" + mac + "/brightness")
+    oldest->hash = hash;
+    oldest->receivedTime = now;
+    oldest->link = link;
+    return false;
+}
+
+void onEspnowConfirm(const uint8_t *target, const uint16_t id, const bool status)
+{
+#if defined(ESP8266)
+    confirmDownlinkCommand(id, status);
+#endif
+#if defined(ESP32)
+    radio_result_t result; // The radio task does not touch the downlink queue. loop() applies the result.
+    result.kind = status ? RRK_CONFIRMED : RRK_REJECTED;
+    result.messageId = id;
+    if (xQueueSend(radioResultQueue, &result, 0) != pdTRUE)
+        ++radioResultOverflowCounter;
+#endif
+}
+
+void sendEspnowMessage(const esp_now_payload_data_t &data, const uint8_t *target, const uint8_t slot)
+{
+    if (isCaptureRunning)
     {
-        flag = true;
-        json["brightness"] = message;
+        const uint8_t broadcast[6]{0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+        captureFrame(CD_TX, data, target ? target : broadcast);
     }
-    if (String(topic) == config.topicPrefix + "/espnow_led/" + mac + "/temperature")
+#if defined(ESP8266)
+    uint16_t id = transmitEspnowMessage(data, target, slot != downlinkNoSlot);
+    if (slot != downlinkNoSlot)
+        downlinkQueue[slot].messageId = id;
+#endif
+#if defined(ESP32)
+    radio_message_t message;
+    memcpy(&message.data, &data, sizeof(esp_now_payload_data_t));
+    if (target)
+        memcpy(message.target, target, 6);
+    message.isBroadcast = !target;
+    if (slot != downlinkNoSlot)
     {
-        flag = true;
-        json["temperature"] = message;
+        message.slot = slot;
+        message.generation = downlinkQueue[slot].generation;
     }
-    if (String(topic) == config.topicPrefix + "/espnow_led/" + mac + "/rgb")
+    if (xQueueSend(radioQueue, &message, 0) != pdTRUE)
+        ++radioQueueOverflowCounter;
+#endif
+    ++metrics.espnowTx[data.payloadsType];
+    if (trafficClientsCount && target) // Downlink commands. The gateway's own broadcasts are not shown.
+        sendTrafficFrame("TX", data, target, -1);
+}
+
+uint16_t transmitEspnowMessage(const esp_now_payload_data_t &data, const uint8_t *target, const bool confirm)
+{
+    char temp[sizeof(esp_now_payload_data_t)]{0};
+    memcpy(&temp, &data, sizeof(esp_now_payload_data_t));
+    if (!target)
+        return myNet.sendBroadcastMessage(temp);
+    return myNet.sendUnicastMessage(temp, target, confirm);
+}
+
+#if defined(ESP32)
+void radioTask(void *parameter)
+{
+    radio_message_t message;
+    for (;;)
     {
-        flag = true;
-        json["rgb"] = message;
+        bool isReceived = xQueueReceive(radioQueue, &message, pdMS_TO_TICKS(1)) == pdTRUE; // Also paces the loop.
+        uint32_t startTime = micros();
+        while (isReceived)
+        {
+            uint16_t id = transmitEspnowMessage(message.data, message.isBroadcast ? nullptr : message.target, message.slot != downlinkNoSlot);
+            if (message.slot != downlinkNoSlot)
+            {
+                radio_result_t result;
+                result.slot = message.slot;
+                result.generation = message.generation;
+                result.messageId = id;
+                if (xQueueSend(radioResultQueue, &result, 0) != pdTRUE)
+                    ++radioResultOverflowCounter;
+            }
+            isReceived = xQueueReceive(radioQueue, &message, 0) == pdTRUE;
+        }
+        myNet.maintenance(); // Receive and confirmation callbacks run here.
+        radioTaskBusyTime += micros() - startTime;
     }
-    if (flag)
+}
+
+void handleRadioResults()
+{
+    radio_result_t result;
+    while (xQueueReceive(radioResultQueue, &result, 0) == pdTRUE)
     {
-        if (message == "restart")
-            outgoingData.payloadsType = ENPT_RESTART;
-        if (message == "update")
-            outgoingData.payloadsType = ENPT_UPDATE;
-        serializeJsonPretty(json, outgoingData.message);
-        char temp[sizeof(esp_now_payload_data_t)]{0};
-        memcpy(&temp, &outgoingData, sizeof(esp_now_payload_data_t));
-        uint8_t target[6];
-        myNet.stringToMac(mac, target);
-        myNet.sendUnicastMessage(temp, target);
+        if (result.kind != RRK_SENT)
+        {
+            confirmDownlinkCommand(result.messageId, result.kind == RRK_CONFIRMED);
+            continue;
+        }
+        downlink_command_t &entry = downlinkQueue[result.slot];
+        if (entry.state == DLS_SENDING && entry.generation == result.generation) // The entry may have been retried or reused meanwhile.
+            entry.messageId = result.messageId;
     }
 }
+#endif
 
 void sendKeepAliveMessage()
 {
     keepAliveMessageTimerSemaphore = false;
     if (isMqttAvailable)
-        mqttPublish((config.topicPrefix + "/espnow_gateway/" + myNet.getNodeMac() + "/status").c_str(), "online", true);
+    {
+        snprintf(topicBuffer, sizeof(topicBuffer), "%s/espnow_gateway/%s/status", config.topicPrefix.c_str(), gatewayMac);
+        mqttPublish(topicBuffer, "online", true);
+    }
     esp_now_payload_data_t outgoingData;
-    outgoingData.deviceType = ENDT_GATEWAY;
-    outgoingData.payloadsType = ENPT_KEEP_ALIVE;
-    DynamicJsonDocument json(sizeof(esp_now_payload_data_t::message));
-    json["MQTT"] = isMqttAvailable ? "online" : "offline";
-    json["frequency"] = 10; // For compatibility with the previous version. Will be removed in future releases.
-    if (config.workMode == ESP_NOW_WIFI && WiFi.isConnected())
-    {
-        ntpWiFiClient.update();
-        uint64_t epochTime = ntpWiFiClient.getEpochTime();
-        struct tm *time = gmtime((time_t *)&epochTime);
-        json["time"] = ntpWiFiClient.getFormattedTime();
-        json["date"] = String(time->tm_mday) + "." + String(time->tm_mon + 1) + "." + String(time->tm_year + 1900);
-    }
-    if (config.workMode == ESP_NOW_LAN && Ethernet.linkStatus() == LinkON)
-    {
-        ntpEthClient.update();
-        uint64_t epochTime = ntpEthClient.getEpochTime();
-        struct tm *time = gmtime((time_t *)&epochTime);
-        json["time"] = ntpEthClient.getFormattedTime();
-        json["date"] = String(time->tm_mday) + "." + String(time->tm_mon + 1) + "." + String(time->tm_year + 1900);
-    }
-    char buffer[sizeof(esp_now_payload_data_t::message)]{0};
-    serializeJsonPretty(json, buffer);
-    memcpy(&outgoingData.message, &buffer, sizeof(esp_now_payload_data_t::message));
-    char temp[sizeof(esp_now_payload_data_t)]{0};
-    memcpy(&temp, &outgoingData, sizeof(esp_now_payload_data_t));
-    myNet.sendBroadcastMessage(temp);
+    buildKeepAliveMessage(outgoingData, isMqttAvailable, isNtpSynced, isNtpSynced ? getLocalEpochTime() : 0);
+    sendEspnowMessage(outgoingData, nullptr, downlinkNoSlot);
 }
 
 void sendAttributesMessage()
@@ -496,7 +1082,7 @@ void sendAttributesMessage()
     uint32_t mins = secs / 60;
     uint32_t hours = mins / 60;
     uint32_t days = hours / 24;
-    DynamicJsonDocument json(sizeof(esp_now_payload_data_t::message));
+    PooledJsonDocument json(768); // For overflow protection.
     json["Type"] = "ESP-NOW gateway";
 #if defined(ESP8266)
     json["MCU"] = "ESP8266";
@@ -504,22 +1090,70 @@ void sendAttributesMessage()
 #if defined(ESP32)
     json["MCU"] = "ESP32";
 #endif
-    json["MAC"] = myNet.getNodeMac();
+    json["MAC"] = (const char *)gatewayMac;
     json["Firmware"] = firmware;
     json["Library"] = myNet.getFirmwareVersion();
+    IPAddress wifiIP = WiFi.localIP();
+    IPAddress lanIP = isEthernetBusy() ? IPAddress() : Ethernet.localIP(); // Reported as 0.0.0.0 while the LAN link connects.
+    char wifiIPBuffer[16]{0};
+    char lanIPBuffer[16]{0};
+    char uptimeBuffer[40]{0};
+    snprintf(wifiIPBuffer, sizeof(wifiIPBuffer), "%u.%u.%u.%u", wifiIP[0], wifiIP[1], wifiIP[2], wifiIP[3]);
+    snprintf(lanIPBuffer, sizeof(lanIPBuffer), "%u.%u.%u.%u", lanIP[0], lanIP[1], lanIP[2], lanIP[3]);
+    snprintf(uptimeBuffer, sizeof(uptimeBuffer), "Days:%u Hours:%u Mins:%u", days, hours - (days * 24), mins - (hours * 60));
     if (config.workMode == ESP_NOW_WIFI)
-        json["IP"] = WiFi.localIP().toString();
-    if (config.workMode == ESP_NOW_LAN)
-        json["IP"] = Ethernet.localIP().toString();
-    json["Uptime"] = "Days:" + String(days) + " Hours:" + String(hours - (days * 24)) + " Mins:" + String(mins - (hours * 60));
-    char buffer[sizeof(esp_now_payload_data_t::message)]{0};
-    serializeJsonPretty(json, buffer);
-    mqttPublish((config.topicPrefix + "/espnow_gateway/" + myNet.getNodeMac() + "/attributes").c_str(), buffer, true);
+        json["IP"] = (const char *)wifiIPBuffer;
+    if (config.workMode == ESP_NOW_LAN || config.workMode == ESP_NOW_DUAL)
+        json["IP"] = (const char *)lanIPBuffer;
+    if (config.workMode == ESP_NOW_DUAL)
+        json["IP WiFi"] = (const char *)wifiIPBuffer;
+    json["Uptime"] = (const char *)uptimeBuffer;
+    json["Queued"] = pendingQueuedCounter;
+    json["Dropped"] = pendingDroppedCounter;
+    json["Replayed"] = pendingReplayedCounter;
+    json["RX queue peak"] = receivedQueueHighWater;
+    json["RX queue overflow"] = receivedQueueOverflowCounter;
+    const mqtt_link_t &mqttLink = mqttLinks[mqttActiveLink];
+    json["MQTT connect attempts"] = mqttLink.connectAttemptCounter;
+    json["MQTT connect latency"] = mqttLink.connectLatency;
+    json["MQTT resolve time"] = mqttLink.stateDuration[MCS_RESOLVE];
+    json["MQTT connect time"] = mqttLink.stateDuration[MCS_CONNECT];
+    json["MQTT subscribe time"] = mqttLink.stateDuration[MCS_SUBSCRIBE];
+    json["MQTT announce time"] = mqttLink.stateDuration[MCS_ANNOUNCE];
+    if (config.workMode == ESP_NOW_DUAL)
+    {
+        json["MQTT link"] = mqttLink.name;
+        json["MQTT link switches"] = mqttLinkSwitchCounter;
+        json["MQTT WiFi RTT"] = mqttLinks[ML_WIFI].rtt;
+        json["MQTT LAN RTT"] = mqttLinks[ML_LAN].rtt;
+        json["MQTT WiFi ping timeouts"] = mqttLinks[ML_WIFI].pingTimeoutCounter;
+        json["MQTT LAN ping timeouts"] = mqttLinks[ML_LAN].pingTimeoutCounter;
+        json["MQTT duplicate commands"] = mqttCommandDuplicateCounter;
+    }
+    json["Boot setup time"] = bootSetupTime;
+    if (config.workMode == ESP_NOW_WIFI || config.workMode == ESP_NOW_DUAL)
+    {
+        json["Boot WiFi time"] = bootWifiTime;
+        json["Boot WiFi scan"] = isWifiScanUsed ? "true" : "false";
+    }
+    json["Boot MQTT time"] = bootMqttTime;
+    json["NTP synced"] = isNtpSynced ? "true" : "false";
+    if (isNtpSynced)
+    {
+        json["NTP sync age"] = (millis() - ntpSyncTime) / 1000;
+        json["NTP drift"] = ntpDrift;
+        json["NTP offset"] = ntpLastOffset;
+        json["NTP round trip"] = ntpLastRoundTrip;
+    }
+    json["NTP failures"] = ntpFailureCounter;
+    json["Boot first frame time"] = bootFirstFrameTime;
+    snprintf(topicBuffer, sizeof(topicBuffer), "%s/espnow_gateway/%s/attributes", config.topicPrefix.c_str(), gatewayMac);
+    mqttPublish(topicBuffer, measureJson(json), true, writeJsonDocument, &json);
 }
 
 void sendConfigMessage()
 {
-    DynamicJsonDocument json(2048); // Same as PubSubClient buffer size.
+    PooledJsonDocument json(1024); // For overflow protection.
     json["platform"] = "mqtt";
     json["name"] = config.deviceName;
     json["unique_id"] = myNet.getNodeMac() + "-1";
@@ -530,65 +1164,272 @@ void sendConfigMessage()
     json["expire_after"] = 30;
     json["force_update"] = "true";
     json["retain"] = "true";
-    char buffer[1024]{0};
-    serializeJsonPretty(json, buffer);
-    mqttPublish((config.topicPrefix + "/binary_sensor/" + myNet.getNodeMac() + "-1" + "/config").c_str(), buffer, true);
-}
-
-String getValue(String data, char separator, uint8_t index)
-{
-    uint8_t found{0};
-    int8_t strIndex[]{0, -1};
-    uint8_t maxIndex = data.length() - 1;
-    for (uint8_t i{0}; i <= maxIndex && found <= index; i++)
-        if (data.charAt(i) == separator || i == maxIndex)
-        {
-            found++;
-            strIndex[0] = strIndex[1] + 1;
-            strIndex[1] = (i == maxIndex) ? i + 1 : i;
-        }
-    return found > index ? data.substring(strIndex[0], strIndex[1]) : "";
+    mqttPublish((config.topicPrefix + "/binary_sensor/" + myNet.getNodeMac() + "-1" + "/config").c_str(), measureJson(json), true, writeJsonDocument, &json);
 }
 
 void loadConfig()
 {
-    EEPROM.begin(4096);
-    if (EEPROM.read(4095) == 254)
+    const config_record_header_t *header = (const config_record_header_t *)configRecord;
+    bool isLoaded{false};
+    for (uint8_t i{0}; i < configSlots; ++i)
     {
-        EEPROM.get(0, config);
-        EEPROM.end();
+        char path[16]{0};
+        snprintf(path, sizeof(path), "/config%u.bin", i);
+        File file = LittleFS.open(path, "r");
+        if (!file)
+            continue;
+        size_t size = file.read(configRecord, sizeof(configRecord));
+        file.close();
+        deviceConfig record;
+        if (!readConfigRecord(size, record))
+            continue;
+        if (isLoaded && (int32_t)(header->sequence - configSequence) <= 0)
+            continue;
+        config = record;
+        configSlot = i;
+        configSequence = header->sequence;
+        isLoaded = true;
     }
-    else
+    if (isLoaded)
+        return;
+    EEPROM.begin(configEepromSize); // The filesystem was erased or this is the first boot after an upgrade.
+    uint8_t marker = EEPROM.read(configEepromSize - 1);
+    if (marker == configEepromMarker)
     {
-        EEPROM.end();
-        saveConfig();
+        for (uint16_t i{0}; i < sizeof(configRecord); ++i)
+            configRecord[i] = EEPROM.read(i);
+        deviceConfig record;
+        if (readConfigRecord(sizeof(config_record_header_t) + header->length, record))
+        {
+            config = record;
+            configSequence = header->sequence;
+        }
     }
-    delay(50);
+    if (marker == legacyConfigMarker)
+        readLegacyConfig();
+    EEPROM.end();
+    saveConfig(); // Also replaces a legacy image, so it is migrated only once.
 }
 
-void saveConfig()
+bool readConfigRecord(const size_t size, deviceConfig &record)
 {
-    EEPROM.begin(4096);
-    EEPROM.write(4095, 254);
-    EEPROM.put(0, config);
-    EEPROM.end();
-    delay(50);
+    const config_record_header_t *header = (const config_record_header_t *)configRecord;
+    const uint8_t *payload = configRecord + sizeof(config_record_header_t);
+    if (size < sizeof(config_record_header_t) || size > sizeof(configRecord) || header->magic != configMagic || header->length != size - sizeof(config_record_header_t))
+        return false;
+    if (header->crc != getCrc32(configRecord + configCrcStart, size - configCrcStart))
+        return false;
+    if (header->version > configVersion) // Written by a newer firmware. Its fields may have a different meaning.
+        return false;
+    const uint8_t *cursor = payload;
+    const uint8_t *end = payload + header->length;
+    return readConfigField(cursor, end, record.deviceName) &&
+           readConfigField(cursor, end, record.espnowNetName) &&
+           readConfigField(cursor, end, record.workMode) &&
+           readConfigField(cursor, end, record.ssid) &&
+           readConfigField(cursor, end, record.password) &&
+           readConfigField(cursor, end, record.mqttHostName) &&
+           readConfigField(cursor, end, record.mqttHostPort) &&
+           readConfigField(cursor, end, record.mqttUserLogin) &&
+           readConfigField(cursor, end, record.mqttUserPassword) &&
+           readConfigField(cursor, end, record.topicPrefix) &&
+           readConfigField(cursor, end, record.ntpHostName) &&
+           readConfigField(cursor, end, record.gmtOffset) &&
+           readConfigField(cursor, end, record.wifiBssid, sizeof(record.wifiBssid)) &&
+           readConfigField(cursor, end, record.wifiChannel) &&
+           readConfigField(cursor, end, record.mqttWindow);
 }
 
-String xmlNode(String tags, String data)
+void readLegacyConfig()
 {
-    String temp = "<" + tags + ">" + data + "</" + tags + ">";
-    return temp;
+    legacy_config_t legacy;
+    EEPROM.get(0, legacy);
+    readLegacyString(legacy.deviceName, config.deviceName);
+    readLegacyString(legacy.espnowNetName, config.espnowNetName);
+    config.workMode = legacy.workMode <= ESP_NOW_LAN ? legacy.workMode : ESP_NOW;
+    readLegacyString(legacy.ssid, config.ssid);
+    readLegacyString(legacy.password, config.password);
+    readLegacyString(legacy.mqttHostName, config.mqttHostName);
+    config.mqttHostPort = legacy.mqttHostPort;
+    readLegacyString(legacy.mqttUserLogin, config.mqttUserLogin);
+    readLegacyString(legacy.mqttUserPassword, config.mqttUserPassword);
+    readLegacyString(legacy.topicPrefix, config.topicPrefix);
+    readLegacyString(legacy.ntpHostName, config.ntpHostName);
+    config.gmtOffset = legacy.gmtOffset;
 }
 
-void setupWebServer()
+void readLegacyString(const legacy_string_t &legacy, String &value)
 {
-    SSDP.setSchemaURL("description.xml");
-    SSDP.setDeviceType("upnp:rootdevice");
-
-    webServer.on("/description.xml", HTTP_GET, [](AsyncWebServerRequest *request)
-                 {
-        String ssdpSend = "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">";
+    uint8_t flags = legacy.image[sizeof(legacy.image) - 1]; // Bits 0-6 are the length of an inline string.
+    uint8_t length = flags & 0x7F;
+#if defined(ESP8266)
+    bool isInline = flags & 0x80; // The core sets bit 7 for an inline string.
+#endif
+#if defined(ESP32)
+    bool isInline = !(flags & 0x80); // The core sets bit 7 for a heap string.
+#endif
+    if (!isInline || length >= sizeof(legacy.image)) // A heap pointer of the previous boot. The default is kept.
+        return;
+    char temp[sizeof(legacy.image)]{0};
+    memcpy(temp, legacy.image, length);
+    value = temp;
+}
+
+void saveConfig()
+{
+    config_record_header_t *header = (config_record_header_t *)configRecord;
+    uint8_t *cursor = configRecord + sizeof(config_record_header_t);
+    const uint8_t *end = configRecord + sizeof(configRecord);
+    if (!(writeConfigField(cursor, end, config.deviceName) &&
+          writeConfigField(cursor, end, config.espnowNetName) &&
+          writeConfigField(cursor, end, config.workMode) &&
+          writeConfigField(cursor, end, config.ssid) &&
+          writeConfigField(cursor, end, config.password) &&
+          writeConfigField(cursor, end, config.mqttHostName) &&
+          writeConfigField(cursor, end, config.mqttHostPort) &&
+          writeConfigField(cursor, end, config.mqttUserLogin) &&
+          writeConfigField(cursor, end, config.mqttUserPassword) &&
+          writeConfigField(cursor, end, config.topicPrefix) &&
+          writeConfigField(cursor, end, config.ntpHostName) &&
+          writeConfigField(cursor, end, config.gmtOffset) &&
+          writeConfigField(cursor, end, config.wifiBssid, sizeof(config.wifiBssid)) &&
+          writeConfigField(cursor, end, config.wifiChannel) &&
+          writeConfigField(cursor, end, config.mqttWindow)))
+        return;
+    size_t size = cursor - configRecord;
+    header->magic = configMagic;
+    header->version = configVersion;
+    header->sequence = ++configSequence;
+    header->length = size - sizeof(config_record_header_t);
+    header->crc = getCrc32(configRecord + configCrcStart, size - configCrcStart);
+    configSlot = (configSlot + 1) % configSlots; // The previous record stays intact if this write is interrupted.
+    char path[16]{0};
+    snprintf(path, sizeof(path), "/config%u.bin", configSlot);
+    File file = LittleFS.open(path, "w");
+    if (file)
+    {
+        file.write(configRecord, size);
+        file.close();
+    }
+    EEPROM.begin(configEepromSize);
+    for (uint16_t i{0}; i < size; ++i)
+        EEPROM.write(i, configRecord[i]);
+    EEPROM.write(configEepromSize - 1, configEepromMarker);
+    EEPROM.end(); // Commits the sector only if a byte changed.
+}
+
+bool readConfigField(const uint8_t *&cursor, const uint8_t *end, String &value)
+{
+    if (cursor == end) // Field added after the record was written.
+        return true;
+    uint8_t length = *cursor;
+    if (cursor + 1 + length > end)
+        return false;
+    char temp[256]{0};
+    memcpy(temp, cursor + 1, length);
+    value = temp;
+    cursor += 1 + length;
+    return true;
+}
+
+bool readConfigField(const uint8_t *&cursor, const uint8_t *end, uint8_t &value)
+{
+    if (cursor == end)
+        return true;
+    if (*cursor != sizeof(value) || cursor + 1 + sizeof(value) > end)
+        return false;
+    value = cursor[1];
+    cursor += 1 + sizeof(value);
+    return true;
+}
+
+bool readConfigField(const uint8_t *&cursor, const uint8_t *end, uint16_t &value)
+{
+    if (cursor == end)
+        return true;
+    if (*cursor != sizeof(value) || cursor + 1 + sizeof(value) > end)
+        return false;
+    value = cursor[1] | (cursor[2] << 8);
+    cursor += 1 + sizeof(value);
+    return true;
+}
+
+bool readConfigField(const uint8_t *&cursor, const uint8_t *end, uint8_t *value, const uint8_t length)
+{
+    if (cursor == end)
+        return true;
+    if (*cursor != length || cursor + 1 + length > end)
+        return false;
+    memcpy(value, cursor + 1, length);
+    cursor += 1 + length;
+    return true;
+}
+
+bool writeConfigField(uint8_t *&cursor, const uint8_t *end, const String &value)
+{
+    if (value.length() > 255 || cursor + 1 + value.length() > end)
+        return false;
+    *cursor++ = value.length();
+    memcpy(cursor, value.c_str(), value.length());
+    cursor += value.length();
+    return true;
+}
+
+bool writeConfigField(uint8_t *&cursor, const uint8_t *end, const uint8_t value)
+{
+    if (cursor + 1 + sizeof(value) > end)
+        return false;
+    *cursor++ = sizeof(value);
+    *cursor++ = value;
+    return true;
+}
+
+bool writeConfigField(uint8_t *&cursor, const uint8_t *end, const uint16_t value)
+{
+    if (cursor + 1 + sizeof(value) > end)
+        return false;
+    *cursor++ = sizeof(value);
+    *cursor++ = value & 0xFF;
+    *cursor++ = value >> 8;
+    return true;
+}
+
+bool writeConfigField(uint8_t *&cursor, const uint8_t *end, const uint8_t *value, const uint8_t length)
+{
+    if (cursor + 1 + length > end)
+        return false;
+    *cursor++ = length;
+    memcpy(cursor, value, length);
+    cursor += length;
+    return true;
+}
+
+uint32_t getCrc32(const uint8_t *data, size_t length)
+{
+    uint32_t crc{0xFFFFFFFF};
+    while (length--)
+    {
+        crc ^= *data++;
+        for (uint8_t i{0}; i < 8; ++i)
+            crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+    return ~crc;
+}
+
+String xmlNode(String tags, String data)
+{
+    String temp = "<" + tags + ">" + data + "</" + tags + ">";
+    return temp;
+}
+
+void setupWebServer()
+{
+    SSDP.setSchemaURL("description.xml");
+    SSDP.setDeviceType("upnp:rootdevice");
+
+    webServer.on("/description.xml", HTTP_GET, [](AsyncWebServerRequest *request)
+                 {
+        String ssdpSend = "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">";
         String ssdpHeader = xmlNode("major", "1");
         ssdpHeader += xmlNode("minor", "0");
         ssdpHeader = xmlNode("specVersion", ssdpHeader);
@@ -609,17 +1450,21 @@ void setupWebServer()
         ssdpSend += "</root>";
         request->send(200, "text/xml", ssdpSend); });
 
+    loadWebAssetTags();
+
     webServer.on("/", HTTP_GET, [](AsyncWebServerRequest *request)
-                 { request->send(LittleFS, "/index.htm"); });
+                 { sendWebAsset(request, webAssets[0]); });
 
     webServer.on("/function.js", HTTP_GET, [](AsyncWebServerRequest *request)
-                 { request->send(LittleFS, "/function.js"); });
+                 { sendWebAsset(request, webAssets[1]); });
 
     webServer.on("/style.css", HTTP_GET, [](AsyncWebServerRequest *request)
-                 { request->send(LittleFS, "/style.css"); });
+                 { sendWebAsset(request, webAssets[2]); });
 
     webServer.on("/setting", HTTP_GET, [](AsyncWebServerRequest *request)
                  {
+        if (config.ssid != request->getParam("ssid")->value())
+            config.wifiChannel = 0; // Cached access point belongs to the previous network.
         config.ssid = request->getParam("ssid")->value();
         config.password = request->getParam("password")->value();
         config.mqttHostName = request->getParam("mqttHostName")->value();
@@ -632,13 +1477,15 @@ void setupWebServer()
         config.workMode = request->getParam("workMode")->value().toInt();
         config.ntpHostName = request->getParam("ntpHostName")->value();
         config.gmtOffset = request->getParam("gmtOffset")->value().toInt();
+        if (request->hasParam("mqttWindow"))
+            config.mqttWindow = constrain(request->getParam("mqttWindow")->value().toInt(), 1, mqttMaxWindow);
         request->send(200);
         saveConfig(); });
 
     webServer.on("/config", HTTP_GET, [](AsyncWebServerRequest *request)
                  {
         String configJson;
-        DynamicJsonDocument json(2048); // For overflow protection.
+        PooledJsonDocument json(2048); // For overflow protection.
         json["firmware"] = firmware;
         json["espnowNetName"] = config.espnowNetName;
         json["deviceName"] = config.deviceName;
@@ -651,77 +1498,1401 @@ void setupWebServer()
         json["topicPrefix"] = config.topicPrefix;
         json["workMode"] = config.workMode;
         json["ntpHostName"] = config.ntpHostName;
+        json["mqttWindow"] = config.mqttWindow;
         json["gmtOffset"] = config.gmtOffset;
         serializeJsonPretty(json, configJson);
         request->send(200, "application/json", configJson); });
 
+    webServer.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request)
+                 {
+        String metricsJson;
+        PooledJsonDocument json(2048); // For overflow protection.
+        buildMetrics(json);
+        serializeJson(json, metricsJson);
+        request->send(200, "application/json", metricsJson); });
+
+    webServer.on("/encoding", HTTP_GET, [](AsyncWebServerRequest *request)
+                 {
+        String encodingJson;
+        PooledJsonDocument json(2048); // For overflow protection.
+        buildEncodingMetrics(json);
+        serializeJson(json, encodingJson);
+        request->send(200, "application/json", encodingJson); });
+
+    webServer.on("/devices", HTTP_GET, [](AsyncWebServerRequest *request)
+                 {
+        AsyncResponseStream *response = request->beginResponseStream("application/json");
+        PooledJsonDocument json(256); // One device at a time.
+        response->print("[");
+        bool isFirst{true};
+        for (uint8_t i{0}; i < deviceRegistryCount; ++i)
+        {
+            device_entry_t device; // A copy. On ESP32 this handler runs in the async_tcp task while loop() may replace the entry.
+#if defined(ESP32)
+            xSemaphoreTake(deviceRegistryMutex, portMAX_DELAY);
+#endif
+            device = deviceRegistry[i];
+#if defined(ESP32)
+            xSemaphoreGive(deviceRegistryMutex);
+#endif
+            if (!device.rxFrames)
+                continue;
+            json.clear();
+            json["MAC"] = device.macHex;
+            json["type"] = getValueName(device.deviceType);
+            json["status"] = device.isOffline ? "offline" : "online";
+            json["last seen"] = (millis() - device.lastSeenTime) / 1000; // Seconds ago.
+            json["keep alive"] = device.keepAliveInterval / 1000;
+            json["RX"] = device.rxFrames;
+            json["TX"] = device.txFrames;
+            if (!isFirst)
+                response->print(",");
+            serializeJson(json, *response);
+            isFirst = false;
+        }
+        response->print("]");
+        request->send(response); });
+
+    webServer.on("/capture", HTTP_GET, [](AsyncWebServerRequest *request)
+                 {
+        if (request->hasParam("segment"))
+        {
+            long segment = request->getParam("segment")->value().toInt();
+            if (segment < 0 || segment >= captureSegmentsCount)
+            {
+                request->send(400, "text/plain", "Invalid segment.");
+                return;
+            }
+            char path[16]{0};
+            snprintf(path, sizeof(path), "/capture%u.bin", (uint8_t)segment);
+            request->send(LittleFS, path, "application/octet-stream", true);
+            return;
+        }
+        if (request->hasParam("start"))
+            captureCommand = CC_START;
+        if (request->hasParam("stop"))
+            captureCommand = CC_STOP;
+        if (request->hasParam("replay"))
+            captureCommand = request->getParam("replay")->value() == "original" ? CC_REPLAY_ORIGINAL_SPEED : CC_REPLAY_MAX_SPEED;
+        String captureJson;
+        PooledJsonDocument json(sizeof(esp_now_payload_data_t::message));
+        json["capture"] = isCaptureRunning ? "running" : "stopped";
+        json["frames"] = captureFramesCounter;
+        json["segment"] = captureSegment;
+        json["sequence"] = captureSequence;
+        JsonObject replay = json.createNestedObject("replay");
+        replay["state"] = isCaptureReplayRunning ? "running" : "stopped";
+        replay["frames"] = captureReplayFrames;
+        replay["busy"] = captureReplayBusyTime;
+        replay["duration"] = captureReplayDuration;
+        serializeJson(json, captureJson);
+        request->send(200, "application/json", captureJson); });
+
     webServer.on("/restart", HTTP_GET, [](AsyncWebServerRequest *request)
                  {request->send(200);
         ESP.restart(); });
 
+#if defined(ESP32)
+    trafficEventQueue = xQueueCreate(trafficEventQueueSize, sizeof(traffic_event_t));
+    deviceRegistryMutex = xSemaphoreCreateMutex();
+#endif
+    trafficSocket.onEvent(onTrafficEvent);
+    webServer.addHandler(&trafficSocket);
+
     webServer.onNotFound([](AsyncWebServerRequest *request)
                          { request->send(404, "text/plain", "File Not Found"); });
 
-    if (config.workMode == ESP_NOW_WIFI)
+    if (config.workMode == ESP_NOW_WIFI || config.workMode == ESP_NOW_DUAL)
         SSDP.begin();
 
     webServer.begin();
 }
 
-void checkMqttAvailability()
+void loadWebAssetTags()
 {
-    mqttAvailabilityCheckTimerSemaphore = false;
+    for (web_asset_t &asset : webAssets)
+    {
+        asset.etag[0] = '\0';
+        File file = LittleFS.open(String(asset.path) + ".gz", "r");
+        if (!file)
+            continue;
+        uint8_t trailer[8]{0}; // CRC32 and size of the uncompressed data.
+        if (file.size() > sizeof(trailer) && file.seek(file.size() - sizeof(trailer)) && file.read(trailer, sizeof(trailer)) == sizeof(trailer))
+            snprintf(asset.etag, sizeof(asset.etag), "\"%02X%02X%02X%02X%02X%02X\"", trailer[3], trailer[2], trailer[1], trailer[0], trailer[5], trailer[4]);
+        file.close();
+    }
+}
 
-    if (config.workMode == ESP_NOW_WIFI)
+void onTrafficEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t length)
+{
+    traffic_event_t event; // The client table is changed by loop() only, which iterates it while sending.
+    event.id = client->id();
+    if (type == WS_EVT_CONNECT)
+        event.type = TE_CONNECT;
+    else if (type == WS_EVT_DISCONNECT)
+        event.type = TE_DISCONNECT;
+    else if (type == WS_EVT_DATA) // Filter: {"MAC":"70039F44BEF7","type":"<payload type name>"}. Empty or missing means any.
+    {
+        AwsFrameInfo *info = (AwsFrameInfo *)arg;
+        if (!info->final || info->index || info->len != length || info->opcode != WS_TEXT)
+            return;
+        PooledJsonDocument json(sizeof(esp_now_payload_data_t::message));
+        if (deserializeJson(json, (const char *)data, length))
+            return;
+        event.type = TE_FILTER;
+        event.isMacFiltered = hexToMac(json["MAC"] | "", event.mac);
+        const char *payloadType = json["type"] | "";
+        if (*payloadType)
+        {
+            event.typeMask = 0;
+            for (uint8_t i{0}; i < metricsPayloadTypes; ++i)
+                if (getValueName((esp_now_payload_type_t)i) == payloadType)
+                    event.typeMask = 1 << i;
+        }
+    }
+    else
+        return;
+#if defined(ESP8266)
+    applyTrafficEvent(event); // Runs between loop() iterations.
+#endif
+#if defined(ESP32)
+    if (xQueueSend(trafficEventQueue, &event, 0) != pdTRUE)
+        ++trafficEventOverflowCounter;
+#endif
+}
+
+void applyTrafficEvent(const traffic_event_t &event)
+{
+    traffic_client_t *trafficClient{nullptr};
+    for (traffic_client_t &candidate : trafficClients)
+        if (candidate.id == event.id)
+            trafficClient = &candidate;
+    if (event.type == TE_CONNECT)
+    {
+        for (traffic_client_t &candidate : trafficClients)
+            if (!candidate.id)
+            {
+                candidate = traffic_client_t();
+                candidate.id = event.id;
+                ++trafficClientsCount;
+                return;
+            }
+        trafficSocket.close(event.id);
+    }
+    if (event.type == TE_DISCONNECT && trafficClient)
+    {
+        trafficClient->id = 0;
+        --trafficClientsCount;
+    }
+    if (event.type == TE_FILTER && trafficClient)
+    {
+        memcpy(trafficClient->mac, event.mac, 6);
+        trafficClient->isMacFiltered = event.isMacFiltered;
+        trafficClient->typeMask = event.typeMask;
+    }
+}
+
+#if defined(ESP32)
+void handleTrafficEvents()
+{
+    traffic_event_t event;
+    while (xQueueReceive(trafficEventQueue, &event, 0) == pdTRUE)
+        applyTrafficEvent(event);
+}
+#endif
+
+void sendTrafficFrame(const char *direction, const esp_now_payload_data_t &data, const uint8_t *mac, const int32_t latency)
+{
+    char frame[160]{0};
+    for (traffic_client_t &trafficClient : trafficClients)
+    {
+        if (!trafficClient.id || (trafficClient.isMacFiltered && memcmp(trafficClient.mac, mac, 6)) || !(trafficClient.typeMask & (1 << (data.payloadsType & 0x0F))))
+            continue;
+        AsyncWebSocketClient *client = trafficSocket.client(trafficClient.id);
+        if (!client) // Gone and its disconnect event was lost.
+        {
+            trafficClient.id = 0;
+            --trafficClientsCount;
+            continue;
+        }
+        if (client->queueIsFull()) // Never wait for a slow browser.
+        {
+            ++trafficClient.droppedFrames;
+            ++trafficDroppedCounter;
+            continue;
+        }
+        if (!frame[0])
+            snprintf(frame, sizeof(frame), "{\"direction\":\"%s\",\"MAC\":\"%02X%02X%02X%02X%02X%02X\",\"device\":\"%s\",\"type\":\"%s\",\"size\":%u,\"latency\":%ld}",
+                     direction, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], getCachedValueName(data.deviceType), getCachedValueName(data.payloadsType),
+                     (unsigned int)getPayloadLength(data), (long)latency);
+        client->text(frame);
+    }
+}
+
+void sendWebAsset(AsyncWebServerRequest *request, const web_asset_t &asset)
+{
+    AsyncWebServerResponse *response;
+    if (asset.etag[0] && request->hasHeader("If-None-Match") && request->getHeader("If-None-Match")->value() == asset.etag)
+        response = request->beginResponse(304);
+    else
+        response = request->beginResponse(LittleFS, asset.path, asset.contentType); // The .gz variant is served with Content-Encoding if present.
+    if (asset.etag[0])
+    {
+        response->addHeader("ETag", asset.etag);
+        response->addHeader("Cache-Control", "no-cache"); // Revalidated on every load, answered with 304 while unchanged.
+    }
+    request->send(response);
+}
+
+void checkWifiConnection()
+{
+    switch (wifiConnectionState)
+    {
+    case WCS_IDLE:
+        if (millis() - wifiStateEnterTime >= wifiScanInterval)
+        {
+            WiFi.scanNetworks(true, false);
+            setWifiConnectionState(WCS_SCAN);
+        }
+        break;
+    case WCS_CONNECT:
         if (WiFi.isConnected())
-            if (!mqttWifiClient.connected())
+        {
+            bootWifiTime = millis();
+            if (config.wifiChannel != WiFi.channel() || memcmp(config.wifiBssid, WiFi.BSSID(), sizeof(config.wifiBssid)))
+            {
+                memcpy(config.wifiBssid, WiFi.BSSID(), sizeof(config.wifiBssid));
+                config.wifiChannel = WiFi.channel();
+                saveConfig();
+            }
+            setWifiConnectionState(WCS_CONNECTED); // Later reconnects are handled by the WiFi auto reconnect.
+            break;
+        }
+        if (millis() - wifiStateEnterTime >= wifiConnectTimeout)
+        {
+            WiFi.disconnect();
+            if (isWifiScanUsed) // The access point was found by a scan but rejected the connection (wrong password). Retried at the scan interval.
+            {
+                setWifiConnectionState(WCS_IDLE);
+                break;
+            }
+            WiFi.scanNetworks(true, false); // The cached access point is unreachable. Scanned at once.
+            setWifiConnectionState(WCS_SCAN);
+        }
+        break;
+    case WCS_SCAN:
+    {
+        int16_t scan = WiFi.scanComplete();
+        if (scan == WIFI_SCAN_RUNNING)
+            break;
+        isWifiScanUsed = true;
+        for (int16_t i{0}; i < scan; ++i)
+            if (WiFi.SSID(i) == config.ssid)
+            {
+                WiFi.begin(config.ssid.c_str(), config.password.c_str(), WiFi.channel(i), WiFi.BSSID(i));
+                WiFi.scanDelete();
+                setWifiConnectionState(WCS_CONNECT);
+                return;
+            }
+        WiFi.scanDelete();
+        setWifiConnectionState(WCS_IDLE);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void setWifiConnectionState(const uint8_t state)
+{
+    wifiConnectionState = state;
+    wifiStateEnterTime = millis();
+}
+
+void checkNtpTime()
+{
+    if (mqttActiveLink == ML_LAN && isEthernetBusy())
+        return;
+    UDP &udp = mqttActiveLink == ML_LAN ? (UDP &)udpEthClient : (UDP &)udpWiFiClient;
+    bool isLinkUp = isMqttLinkUp(mqttActiveLink);
+
+    switch (ntpState)
+    {
+    case NS_IDLE:
+        if (!isLinkUp || (int32_t)(millis() - ntpNextRequestTime) < 0)
+            break;
+        if (!isNtpHostResolved)
+            startHostResolve(ntpResolver, config.ntpHostName.c_str(), mqttActiveLink);
+        ntpState = isNtpHostResolved ? NS_REQUEST : NS_RESOLVE;
+        break;
+    case NS_RESOLVE:
+    {
+        uint8_t result = checkHostResolve(ntpResolver, ntpHostIP);
+        if (result == HRS_PENDING)
+            break;
+        if (result != HRS_DONE)
+        {
+            failNtpRequest();
+            break;
+        }
+        isNtpHostResolved = true;
+        ntpState = NS_REQUEST;
+        break;
+    }
+    case NS_REQUEST:
+    {
+        while (udp.parsePacket() > 0) // Drops late responses to previous requests. Unread data is discarded by the next call.
+            ;
+        uint8_t request[ntpPacketSize]{0};
+        request[0] = 0x23; // LI 0, version 4, mode 3 (client).
+        if (!isLinkUp || !udp.beginPacket(ntpHostIP, 123) || udp.write(request, ntpPacketSize) != ntpPacketSize || !udp.endPacket())
+        {
+            failNtpRequest();
+            break;
+        }
+        ntpRequestTime = millis();
+        ntpState = NS_WAIT;
+        break;
+    }
+    case NS_WAIT:
+        if (udp.parsePacket() >= ntpPacketSize && readNtpResponse(udp))
+        {
+            ntpConsecutiveFailures = 0;
+            ntpRetryBackoff = ntpRetryInterval;
+            ntpNextRequestTime = millis() + ntpSyncInterval;
+            ntpState = NS_IDLE;
+        }
+        else if (millis() - ntpRequestTime >= ntpResponseTimeout)
+            failNtpRequest();
+        break;
+    default:
+        break;
+    }
+}
+
+bool readNtpResponse(UDP &udp)
+{
+    uint8_t response[ntpPacketSize]{0};
+    if (udp.read(response, ntpPacketSize) != ntpPacketSize)
+        return false;
+    if ((response[0] & 0x07) != 4 || response[1] == 0) // Not a server response or a kiss-of-death packet.
+        return false;
+    uint32_t now = millis();
+    uint32_t roundTrip = now - ntpRequestTime;
+    uint32_t seconds = (uint32_t)response[40] << 24 | (uint32_t)response[41] << 16 | (uint32_t)response[42] << 8 | response[43];
+    uint32_t fraction = (uint32_t)response[44] << 24 | (uint32_t)response[45] << 16 | (uint32_t)response[46] << 8 | response[47];
+    // Transmit timestamp plus half of the round trip. Valid until 2036 (NTP era 1).
+    uint64_t epoch = (uint64_t)(seconds - ntpEpochOffset) * 1000 + (((uint64_t)fraction * 1000) >> 32) + roundTrip / 2;
+    if (isNtpSynced)
+    {
+        uint32_t elapsed = now - ntpSyncTime;
+        uint64_t predicted = ntpSyncEpoch + elapsed + (int64_t)elapsed * ntpDrift / 1000000;
+        ntpLastOffset = (int32_t)(int64_t)(epoch - predicted);
+        if (elapsed >= ntpMinDriftInterval)
+        {
+            int32_t drift = ntpDrift + (int32_t)((int64_t)ntpLastOffset * 1000000 / elapsed);
+            if (drift >= -ntpMaxDrift && drift <= ntpMaxDrift)
+                ntpDrift = drift;
+        }
+    }
+    ntpSyncEpoch = epoch;
+    ntpSyncTime = now;
+    ntpLastRoundTrip = roundTrip;
+    isNtpSynced = true;
+    return true;
+}
+
+void failNtpRequest()
+{
+    ++ntpFailureCounter;
+    if (++ntpConsecutiveFailures >= ntpMaxFailures)
+    {
+        isNtpHostResolved = false; // The address may have changed.
+        ntpConsecutiveFailures = 0;
+    }
+    ntpNextRequestTime = millis() + ntpRetryBackoff;
+    ntpRetryBackoff = ntpRetryBackoff * 2 > ntpSyncInterval ? ntpSyncInterval : ntpRetryBackoff * 2;
+    ntpState = NS_IDLE;
+}
+
+uint32_t getLocalEpochTime()
+{
+    uint32_t elapsed = millis() - ntpSyncTime;
+    uint64_t epoch = ntpSyncEpoch + elapsed + (int64_t)elapsed * ntpDrift / 1000000;
+    return epoch / 1000 + config.gmtOffset;
+}
+
+void startHostResolve(host_resolver_t &resolver, const char *hostName, const uint8_t link)
+{
+    resolver.hostName = hostName;
+    resolver.link = link;
+    resolver.startTime = millis();
+    IPAddress address;
+    if (address.fromString(hostName))
+    {
+        resolver.address = (uint32_t)address;
+        resolver.state = HRS_DONE;
+        return;
+    }
+    resolver.state = HRS_PENDING;
+    if (link == ML_LAN) // The Ethernet library's DNSClient waits for the response.
+    {
+        if (!sendDnsQuery(resolver))
+            resolver.state = HRS_FAILED;
+        return;
+    }
+    ip_addr_t cached;
+    err_t result = dns_gethostbyname(hostName, &cached, onHostResolved, &resolver); // WiFi.hostByName() waits for the callback.
+    if (result == ERR_OK)
+    {
+        resolver.address = ip_addr_get_ip4_u32(&cached);
+        resolver.state = HRS_DONE;
+    }
+    else if (result != ERR_INPROGRESS)
+        resolver.state = HRS_FAILED;
+}
+
+uint8_t checkHostResolve(host_resolver_t &resolver, IPAddress &address)
+{
+    uint8_t state = resolver.state;
+    if (state == HRS_PENDING && resolver.link == ML_LAN)
+        readDnsResponse(resolver);
+    if (state == HRS_PENDING && millis() - resolver.startTime >= hostResolveTimeout && resolver.state.compare_exchange_strong(state, HRS_FAILED) && resolver.link == ML_LAN)
+        resolver.udp.stop();
+    state = resolver.state;
+    if (state == HRS_DONE)
+        address = IPAddress(resolver.address.load());
+    return state;
+}
+
+void onHostResolved(const char *name, const ip_addr_t *ipaddr, void *callbackArg)
+{
+    host_resolver_t &resolver = *(host_resolver_t *)callbackArg;
+    if (!resolver.hostName || strcmp(name, resolver.hostName))
+        return;
+    if (ipaddr)
+        resolver.address = ip_addr_get_ip4_u32(ipaddr);
+    uint8_t state{HRS_PENDING};
+    resolver.state.compare_exchange_strong(state, ipaddr ? HRS_DONE : HRS_FAILED); // Ignored if it timed out meanwhile.
+}
+
+bool sendDnsQuery(host_resolver_t &resolver)
+{
+    resolver.queryId = random(1, 0x10000);
+    memset(dnsBuffer, 0, 12);
+    dnsBuffer[0] = resolver.queryId >> 8;
+    dnsBuffer[1] = resolver.queryId & 0xFF;
+    dnsBuffer[2] = 0x01; // Recursion desired.
+    dnsBuffer[5] = 1; // One question.
+    uint16_t length{12};
+    const char *label = resolver.hostName;
+    while (*label)
+    {
+        const char *dot = strchr(label, '.');
+        size_t labelLength = dot ? dot - label : strlen(label);
+        if (!labelLength || labelLength > 63 || length + 1 + labelLength + 5 > sizeof(dnsBuffer))
+            return false;
+        dnsBuffer[length++] = labelLength;
+        memcpy(dnsBuffer + length, label, labelLength);
+        length += labelLength;
+        label += labelLength + (dot ? 1 : 0);
+    }
+    const uint8_t question[5]{0, 0, 1, 0, 1}; // End of the name, type A, class IN.
+    memcpy(dnsBuffer + length, question, sizeof(question));
+    length += sizeof(question);
+    resolver.udp.begin(49152 + random(16384)); // Ephemeral port. Late responses to an earlier query go to a closed socket.
+    if (!resolver.udp.beginPacket(Ethernet.dnsServerIP(), dnsPort) || resolver.udp.write(dnsBuffer, length) != length || !resolver.udp.endPacket())
+    {
+        resolver.udp.stop();
+        return false;
+    }
+    return true;
+}
+
+void readDnsResponse(host_resolver_t &resolver)
+{
+    if (resolver.udp.parsePacket() <= 0)
+        return;
+    int read = resolver.udp.read(dnsBuffer, sizeof(dnsBuffer));
+    uint16_t length = read > 0 ? read : 0;
+    if (length < 12 || (dnsBuffer[0] << 8 | dnsBuffer[1]) != resolver.queryId || !(dnsBuffer[2] & 0x80))
+        return; // Not the response to this query. Keep waiting.
+    uint16_t answers = dnsBuffer[6] << 8 | dnsBuffer[7];
+    uint16_t position{12};
+    uint8_t state{HRS_FAILED};
+    if ((dnsBuffer[3] & 0x0F) == 0 && skipDnsName(position, length) && (position += 4) <= length) // No error. The question is skipped.
+        for (; answers; --answers)
+        {
+            if (!skipDnsName(position, length) || position + 10 > length)
+                break;
+            uint16_t type = dnsBuffer[position] << 8 | dnsBuffer[position + 1];
+            uint16_t dataClass = dnsBuffer[position + 2] << 8 | dnsBuffer[position + 3];
+            uint16_t dataLength = dnsBuffer[position + 8] << 8 | dnsBuffer[position + 9];
+            position += 10;
+            if (position + dataLength > length)
+                break;
+            if (type == 1 && dataClass == 1 && dataLength == 4) // The first A record. CNAME records come before it.
             {
-                isMqttAvailable = false;
-                if (mqttWifiClient.connect(mqttUserID, config.mqttUserLogin.c_str(), config.mqttUserPassword.c_str()))
-                {
-                    isMqttAvailable = true;
-
-                    mqttWifiClient.subscribe((config.topicPrefix + "/espnow_gateway/#").c_str());
-                    mqttWifiClient.subscribe((config.topicPrefix + "/espnow_switch/#").c_str());
-                    mqttWifiClient.subscribe((config.topicPrefix + "/espnow_led/#").c_str());
-
-                    sendConfigMessage();
-                    sendAttributesMessage();
-                    sendKeepAliveMessage();
-                }
+                resolver.address = (uint32_t)IPAddress(dnsBuffer[position], dnsBuffer[position + 1], dnsBuffer[position + 2], dnsBuffer[position + 3]);
+                state = HRS_DONE;
+                break;
             }
+            position += dataLength;
+        }
+    resolver.state = state;
+    resolver.udp.stop();
+}
+
+bool skipDnsName(uint16_t &position, const uint16_t length)
+{
+    while (position < length)
+    {
+        uint8_t labelLength = dnsBuffer[position];
+        if (!labelLength)
+        {
+            ++position;
+            return true;
+        }
+        if ((labelLength & 0xC0) == 0xC0) // Compression pointer. Ends the name.
+        {
+            position += 2;
+            return position <= length;
+        }
+        position += 1 + labelLength;
+    }
+    return false;
+}
+
+bool isMqttLinkEnabled(const uint8_t link)
+{
+    if (config.workMode == ESP_NOW_DUAL)
+        return true;
+    return link == ML_LAN ? config.workMode == ESP_NOW_LAN : config.workMode == ESP_NOW_WIFI;
+}
+
+bool isMqttLinkUp(const uint8_t link)
+{
+    return link == ML_LAN ? Ethernet.linkStatus() == LinkON : WiFi.isConnected();
+}
 
-    if (config.workMode == ESP_NOW_LAN)
-        if (Ethernet.linkStatus() == LinkON)
-            if (!mqttEthClient.connected())
+bool isEthernetBusy()
+{
+#if defined(ESP8266)
+    return false;
+#endif
+#if defined(ESP32)
+    return mqttLinks[ML_LAN].connectResult == MCR_PENDING; // The W5500 driver is not thread safe.
+#endif
+}
+
+void checkMqttAvailability(const uint8_t link)
+{
+    mqtt_link_t &mqttLink = mqttLinks[link];
+    PubSubClient &client = *mqttLink.client;
+
+#if defined(ESP32)
+    if (mqttLink.connectResult == MCR_PENDING) // The connect task owns the client until it returns. Both timeouts bound the wait.
+        return;
+#endif
+    bool isLinkUp = isMqttLinkUp(link);
+    if (mqttLink.state != MCS_IDLE && !isLinkUp)
+    {
+        failMqttConnection(link);
+        return;
+    }
+
+    switch (mqttLink.state)
+    {
+    case MCS_IDLE:
+        if (isLinkUp && (int32_t)(millis() - mqttLink.nextAttemptTime) >= 0)
+        {
+            ++mqttLink.connectAttemptCounter;
+            mqttLink.connectStartTime = millis();
+            memset(mqttLink.stateDuration, 0, sizeof(mqttLink.stateDuration));
+            setMqttConnectionState(link, mqttLink.isHostResolved ? MCS_CONNECT : MCS_RESOLVE);
+        }
+        break;
+    case MCS_RESOLVE:
+    {
+        if (mqttLink.step++ == 0)
+            startHostResolve(mqttLink.resolver, config.mqttHostName.c_str(), link);
+        uint8_t result = checkHostResolve(mqttLink.resolver, mqttLink.hostIP);
+        if (result == HRS_PENDING)
+            break;
+        if (result == HRS_FAILED)
+        {
+            failMqttConnection(link);
+            break;
+        }
+        mqttLink.isHostResolved = true;
+        client.setServer(mqttLink.hostIP, config.mqttHostPort);
+        setMqttConnectionState(link, MCS_CONNECT);
+        break;
+    }
+    case MCS_CONNECT:
+    {
+#if defined(ESP8266)
+        bool isConnected = connectMqttLink(link); // Blocks for up to the TCP connect timeout, plus the CONNACK timeout once the broker accepted.
+#endif
+#if defined(ESP32)
+        uint8_t result = mqttLink.connectResult;
+        if (result == MCR_NONE)
+        {
+            mqttLink.connectResult = MCR_PENDING;
+            if (xQueueSend(mqttConnectQueue, &link, 0) != pdTRUE)
+                mqttLink.connectResult = MCR_FAILED;
+            break;
+        }
+        mqttLink.connectResult = MCR_NONE;
+        bool isConnected = result == MCR_CONNECTED;
+#endif
+        if (isConnected)
+            setMqttConnectionState(link, MCS_SUBSCRIBE);
+        else
+        {
+            mqttLink.isHostResolved = false; // The address may have changed.
+            failMqttConnection(link);
+        }
+        break;
+    }
+    case MCS_SUBSCRIBE: // One subscription per call. Both links subscribe, so a failover needs no resubscription.
+        if (!subscribeMqttTopic(link, mqttLink.step++))
+        {
+            mqttLink.connectLatency = millis() - mqttLink.connectStartTime;
+            mqttLink.backoff = mqttMinBackoff;
+            if (isMqttAvailable) // The other link is in use. This one is a ready backup.
             {
-                isMqttAvailable = false;
-                if (mqttEthClient.connect(mqttUserID, config.mqttUserLogin.c_str(), config.mqttUserPassword.c_str()))
-                {
-                    isMqttAvailable = true;
-
-                    mqttEthClient.subscribe((config.topicPrefix + "/espnow_gateway/#").c_str());
-                    mqttEthClient.subscribe((config.topicPrefix + "/espnow_switch/#").c_str());
-                    mqttEthClient.subscribe((config.topicPrefix + "/espnow_led/#").c_str());
-
-                    sendConfigMessage();
-                    sendAttributesMessage();
-                    sendKeepAliveMessage();
-                }
+                setMqttConnectionState(link, MCS_CONNECTED);
+                break;
             }
+            switchMqttLink(link);
+        }
+        break;
+    case MCS_ANNOUNCE: // One announcement per call. Only the link in use announces.
+        if (mqttLink.step == 0)
+        {
+            if (!bootMqttTime)
+                bootMqttTime = millis();
+            sendConfigMessage();
+        }
+        if (mqttLink.step == 1)
+            sendAttributesMessage();
+        if (mqttLink.step == 2)
+        {
+            sendKeepAliveMessage();
+            setMqttConnectionState(link, MCS_CONNECTED);
+            break;
+        }
+        ++mqttLink.step;
+        break;
+    case MCS_CONNECTED:
+        if (!client.connected())
+        {
+            failMqttConnection(link);
+            break;
+        }
+        if (config.workMode != ESP_NOW_DUAL)
+            break;
+        if (mqttLink.isPingPending && millis() - mqttLink.pingSentTime >= mqttPingTimeout)
+        {
+            ++mqttLink.pingTimeoutCounter;
+            failMqttConnection(link); // TCP may take minutes to notice a dead path.
+            break;
+        }
+        if (!mqttLink.isPingPending && millis() - mqttLink.pingSentTime >= mqttPingInterval)
+            sendMqttPing(link);
+        break;
+    default:
+        break;
+    }
+}
+
+void setMqttConnectionState(const uint8_t link, const uint8_t state)
+{
+    mqtt_link_t &mqttLink = mqttLinks[link];
+    if (mqttLink.state < MCS_CONNECTED)
+        mqttLink.stateDuration[mqttLink.state] += millis() - mqttLink.stateEnterTime;
+    mqttLink.state = state;
+    mqttLink.step = 0;
+    mqttLink.stateEnterTime = millis();
+}
+
+void failMqttConnection(const uint8_t link)
+{
+    mqtt_link_t &mqttLink = mqttLinks[link];
+    if (mqttLink.client->connected())
+        mqttLink.client->disconnect();
+    mqttLink.isPingPending = false;
+    mqttLink.rtt = 0;
+#if defined(ESP8266)
+    if (isMqttAvailable && link != mqttActiveLink) // A blocking attempt of the standby link stalls publishing on the active one.
+        mqttLink.backoff = mqttMaxBackoff;
+#endif
+    mqttLink.nextAttemptTime = millis() + mqttLink.backoff + random(mqttLink.backoff / 2); // Exponential backoff with jitter.
+    mqttLink.backoff = mqttLink.backoff * 2 > mqttMaxBackoff ? mqttMaxBackoff : mqttLink.backoff * 2;
+    setMqttConnectionState(link, MCS_IDLE);
+    if (link != mqttActiveLink)
+        return;
+    isMqttAvailable = false;
+    for (uint8_t i{0}; i < ML_COUNT; ++i)
+    {
+        if (i == link || !isMqttLinkEnabled(i))
+            continue;
+        if (mqttLinks[i].state == MCS_CONNECTED)
+            switchMqttLink(i); // Failover to the ready backup. Queued messages are replayed over it.
+        else if (mqttLinks[i].state == MCS_IDLE)
+        {
+            mqttLinks[i].nextAttemptTime = millis(); // The standby link was throttled while this one was in use.
+            mqttLinks[i].backoff = mqttMinBackoff;
+        }
+    }
+}
+
+void switchMqttLink(const uint8_t link)
+{
+    if (link != mqttActiveLink)
+        ++mqttLinkSwitchCounter;
+    mqttActiveLink = link;
+    expireMqttQos1(mqttQos1, millis()); // Unacknowledged messages are sent again over the new connection.
+    if (isMqttAvailable)
+        return;
+    isMqttAvailable = true;
+    discoveryCacheCount = 0; // The broker may have lost retained messages.
+    setMqttConnectionState(link, MCS_ANNOUNCE);
+}
+
+void sendMqttPing(const uint8_t link)
+{
+    mqtt_link_t &mqttLink = mqttLinks[link];
+    snprintf(topicBuffer, sizeof(topicBuffer), "%s/espnow_gateway/%s/ping/%s", config.topicPrefix.c_str(), gatewayMac, mqttLink.name);
+    mqttLink.pingSentTime = millis();
+    mqttLink.isPingPending = mqttLink.client->publish(topicBuffer, "");
+}
+
+void onMqttPing(const uint8_t link)
+{
+    mqtt_link_t &mqttLink = mqttLinks[link];
+    if (!mqttLink.isPingPending)
+        return;
+    mqttLink.isPingPending = false;
+    uint16_t rtt = millis() - mqttLink.pingSentTime;
+    mqttLink.rtt = mqttLink.rtt ? (mqttLink.rtt * 3 + rtt) / 4 : rtt;
+    const mqtt_link_t &activeLink = mqttLinks[mqttActiveLink];
+    if (link != mqttActiveLink && mqttLink.state == MCS_CONNECTED && activeLink.state == MCS_CONNECTED && activeLink.rtt && mqttLink.rtt + mqttRttHysteresis < activeLink.rtt)
+        switchMqttLink(link); // Both links stay connected, so switching needs no announcement.
+}
+
+bool connectMqttLink(const uint8_t link)
+{
+    mqtt_link_t &mqttLink = mqttLinks[link];
+#if defined(ESP8266)
+    mqttLink.network->setTimeout(mqttConnectTimeout); // Read by WiFiClient::connect(). Ignored by the Ethernet client.
+#endif
+    bool isConnected = mqttLink.client->connect(config.workMode == ESP_NOW_DUAL ? mqttLink.userID : mqttUserID, config.mqttUserLogin.c_str(), config.mqttUserPassword.c_str(), nullptr, 0, false, nullptr, false); // Persistent session for QoS 1.
+#if defined(ESP8266)
+    mqttLink.network->setTimeout(mqttWriteTimeout);
+#endif
+    return isConnected;
+}
+
+#if defined(ESP32)
+void mqttConnectTask(void *parameter)
+{
+    uint8_t link;
+    for (;;)
+        if (xQueueReceive(mqttConnectQueue, &link, portMAX_DELAY) == pdTRUE)
+            mqttLinks[link].connectResult = connectMqttLink(link) ? MCR_CONNECTED : MCR_FAILED;
+}
+#endif
+
+bool subscribeMqttTopic(const uint8_t link, const uint8_t index)
+{
+    const uint8_t deviceTypesCount = sizeof(mqttCommandDeviceTypes) / sizeof(mqttCommandDeviceTypes[0]);
+    const uint8_t commandsCount = sizeof(mqttCommands) / sizeof(mqttCommands[0]);
+    if (index == 0)
+        snprintf(topicBuffer, sizeof(topicBuffer), "%s/espnow_gateway/%s", config.topicPrefix.c_str(), gatewayMac);
+    else if (index <= deviceTypesCount) // Device root topics for "update" and "restart" commands.
+        snprintf(topicBuffer, sizeof(topicBuffer), "%s/%s/+", config.topicPrefix.c_str(), mqttCommandDeviceTypes[index - 1]);
+    else if (index <= deviceTypesCount + commandsCount)
+    {
+        const mqtt_command_t &mqttCommand = mqttCommands[index - deviceTypesCount - 1];
+        snprintf(topicBuffer, sizeof(topicBuffer), "%s/%s/+/%s", config.topicPrefix.c_str(), mqttCommand.deviceType, mqttCommand.command);
+    }
+    else if (index == deviceTypesCount + commandsCount + 1 && config.workMode == ESP_NOW_DUAL) // Round trip echo of this link only.
+        snprintf(topicBuffer, sizeof(topicBuffer), "%s/espnow_gateway/%s/ping/%s", config.topicPrefix.c_str(), gatewayMac, mqttLinks[link].name);
+    else
+        return false;
+    mqttLinks[link].client->subscribe(topicBuffer);
+    return true;
 }
 
 void mqttPublish(const char *topic, const char *payload, bool retained)
 {
-    if (config.workMode == ESP_NOW_WIFI)
-        mqttWifiClient.publish(topic, payload, retained);
-    if (config.workMode == ESP_NOW_LAN)
-        mqttEthClient.publish(topic, payload, retained);
+    mqttPublish(topic, strlen(payload), retained, writeText, payload);
+}
+
+void mqttPublish(const char *topic, const size_t length, bool retained, payload_writer_t writer, const void *context)
+{
+    if (isBenchmarkRunning)
+    {
+        hashPrint output; // Serialization cost is part of the measurement.
+        writer(output, context);
+        return;
+    }
+    PubSubClient &client = *mqttLinks[mqttActiveLink].client;
+    if (!isMqttAvailable || !client.connected()) // A previous write in the same message failed the link.
+    {
+        ++metrics.mqttTxFailed;
+        return;
+    }
+    uint32_t packetSize = strlen(topic) + length + 5; // Plus fixed header and topic length.
+    if (packetSize > metrics.mqttMaxPacket)
+        metrics.mqttMaxPacket = packetSize;
+    if (publishMqttQos1(client, topic, length, retained, writer, context))
+        return;
+    ++mqttQos0Counter;
+    bool isPublished = client.beginPublish(topic, length, retained);
+    if (isPublished)
+    {
+        chunkedPrint output(client);
+        writer(output, context);
+        output.flushChunk();
+        isPublished = client.endPublish();
+    }
+    if (isPublished)
+    {
+        ++metrics.mqttTx;
+        recordPublishLatency();
+    }
+    else
+        ++metrics.mqttTxFailed;
+}
+
+bool publishMqttQos1(PubSubClient &client, const char *topic, const size_t length, bool retained, payload_writer_t writer, const void *context)
+{
+    mqtt_qos1_publish_result_t result = addMqttQos1Publish(mqttQos1, config.mqttWindow, topic, length, retained, writer, context, millis());
+    if (result == MQPR_FULL)
+        return false;
+    if (result == MQPR_LENGTH_MISMATCH)
+    {
+        ++metrics.mqttTxFailed;
+        return true;
+    }
+    uint16_t packetLength = mqttQos1.entries[mqttQos1.count - 1].length;
+    if (client.write(getMqttQos1Packet(mqttQos1, mqttQos1.count - 1), packetLength) != packetLength) // Not waiting for PUBACK. A short write leaves the stream mid packet.
+    {
+        failMqttConnection(mqttActiveLink); // The packet is retransmitted after the reconnect.
+        return true;
+    }
+    ++metrics.mqttTx;
+    recordPublishLatency();
+    return true;
+}
+
+bool readMqttAcks(const uint8_t link)
+{
+    mqtt_link_t &mqttLink = mqttLinks[link];
+    if (!mqttLink.client->connected())
+        return true;
+    Client &network = *mqttLink.network;
+    while (network.peek() == 0x40) // PUBACK. PubSubClient ignores it, so it is taken off the stream first.
+    {
+        if (network.available() < 4)
+            return false; // Incomplete. PubSubClient would consume it.
+        uint8_t ack[4]{0};
+        network.read(ack, sizeof(ack));
+        acknowledgeMqttQos1(mqttQos1, ack);
+    }
+    return true;
+}
+
+void retransmitMqttInflight()
+{
+    if (!retransmitMqttQos1(mqttQos1, *mqttLinks[mqttActiveLink].client, millis()))
+        failMqttConnection(mqttActiveLink);
+}
+
+bool isMqttWindowOpen()
+{
+    return isMqttQos1WindowOpen(mqttQos1, config.mqttWindow, mqttWindowReserve);
+}
+
+void writeText(Print &output, const void *context)
+{
+    const char *text = (const char *)context;
+    output.write((const uint8_t *)text, strlen(text));
+}
+
+const char *getGatewayMac()
+{
+    return gatewayMac;
+}
+
+void restartGateway()
+{
+    ESP.restart();
+}
+
+const char *getTopicPrefix()
+{
+    return config.topicPrefix.c_str();
+}
+
+void updateDeviceRegistry(const esp_now_payload_data_t &incomingData, const uint8_t *sender)
+{
+    device_entry_t *device = getDevice(sender, incomingData.deviceType);
+    uint32_t now = millis();
+    ++device->rxFrames;
+    device->lastSeenTime = now;
+    if (incomingData.payloadsType == ENPT_KEEP_ALIVE)
+    {
+        if (device->lastKeepAliveTime)
+            device->keepAliveInterval = now - device->lastKeepAliveTime;
+        device->lastKeepAliveTime = now;
+    }
+    if (device->isOffline && isMqttAvailable)
+    {
+        device->isOffline = false;
+        if (incomingData.payloadsType != ENPT_KEEP_ALIVE) // Keep alive publishes "online" itself.
+            mqttPublish(buildDeviceTopic(sender, incomingData.deviceType, "status"), "online", true);
+    }
+}
+
+void checkDeviceAvailability()
+{
+    availabilityCheckTimerSemaphore = false;
+    if (!isMqttAvailable)
+        return;
+    for (uint8_t i{0}; i < deviceRegistryCount; ++i)
+    {
+        device_entry_t &device = deviceRegistry[i];
+        if (device.isOffline || !device.keepAliveInterval || millis() - device.lastSeenTime <= device.keepAliveInterval * deviceOfflineFactor)
+            continue;
+        device.isOffline = true;
+        mqttPublish(buildDeviceTopic(device.mac, device.deviceType, "status"), "offline", true);
+    }
+}
+
+void addHistogramValue(uint32_t *histogram, uint32_t value)
+{
+    uint8_t bucket{0};
+    while (value > 1 && bucket < metricsHistogramBuckets - 1)
+    {
+        value >>= 1;
+        ++bucket;
+    }
+    ++histogram[bucket];
+}
+
+void recordPublishLatency()
+{
+    if (publishedFrameReceivedTime) // Not for the gateway's own messages and replayed frames.
+        addHistogramValue(metrics.latency, millis() - publishedFrameReceivedTime);
+}
+
+void updateHeapMetrics()
+{
+    uint32_t freeHeap = ESP.getFreeHeap();
+    if (freeHeap < metrics.minFreeHeap)
+        metrics.minFreeHeap = freeHeap;
+    if (millis() - metrics.lastHeapCheckTime < 1000) // The largest free block search walks the heap.
+        return;
+    metrics.lastHeapCheckTime = millis();
+#if defined(ESP8266)
+    uint32_t maxFreeBlock = ESP.getMaxFreeBlockSize();
+#endif
+#if defined(ESP32)
+    uint32_t maxFreeBlock = ESP.getMaxAllocHeap();
+#endif
+    if (maxFreeBlock < metrics.minMaxFreeBlock)
+        metrics.minMaxFreeBlock = maxFreeBlock;
+}
+
+void buildMetrics(JsonDocument &json)
+{
+    uint32_t rxTotal{0};
+    JsonObject espnowRx = json.createNestedObject("ESP-NOW RX");
+    JsonObject espnowTx = json.createNestedObject("ESP-NOW TX");
+    for (uint8_t i{0}; i < metricsPayloadTypes; ++i)
+    {
+        rxTotal += metrics.espnowRx[i];
+        if (metrics.espnowRx[i])
+            espnowRx[getValueName((esp_now_payload_type_t)i)] = metrics.espnowRx[i];
+        if (metrics.espnowTx[i])
+            espnowTx[getValueName((esp_now_payload_type_t)i)] = metrics.espnowTx[i];
+    }
+    uint32_t interval = millis() - metrics.lastPublishTime;
+    json["RX rate"] = interval ? (rxTotal - metrics.lastRxTotal) * 1000.0 / interval : 0; // Frames per second since the previous metrics message.
+    json["MQTT TX"] = metrics.mqttTx;
+    json["MQTT max packet"] = metrics.mqttMaxPacket;
+    json["MQTT buffer"] = mqttLinks[mqttActiveLink].client->getBufferSize();
+    JsonObject qos1 = json.createNestedObject("MQTT QoS 1");
+    qos1["In flight"] = mqttQos1.count;
+    qos1["In flight peak"] = mqttQos1.peak;
+    qos1["Acknowledged"] = mqttQos1.ackedCounter;
+    qos1["Retransmitted"] = mqttQos1.retransmitCounter;
+    qos1["QoS 0 fallback"] = mqttQos0Counter;
+    JsonObject coalesced = json.createNestedObject("Coalesced");
+    coalesced["Merged"] = coalesceMergedCounter;
+    coalesced["Suppressed"] = coalesceSuppressedCounter;
+    coalesced["Bypassed"] = coalesceBypassedCounter;
+    JsonObject downlink = json.createNestedObject("Downlink");
+    downlink["Merged"] = downlinkMergedCounter;
+    downlink["Retried"] = downlinkRetriedCounter;
+    downlink["Delivered"] = downlinkDeliveredCounter;
+    downlink["Failed"] = downlinkFailedCounter;
+    JsonObject dropped = json.createNestedObject("Dropped");
+    dropped["RX queue overflow"] = receivedQueueOverflowCounter;
+    dropped["Duplicate"] = duplicateCounter;
+    dropped["Traffic stream"] = trafficDroppedCounter;
+#if defined(ESP32)
+    dropped["Traffic events"] = trafficEventOverflowCounter;
+#endif
+    dropped["Pending queue full"] = pendingDroppedCounter;
+    dropped["MQTT publish failed"] = metrics.mqttTxFailed;
+    dropped["MQTT not acknowledged"] = mqttQos1.lostCounter;
+    dropped["Downlink queue full"] = downlinkOverflowCounter;
+#if defined(ESP32)
+    dropped["Radio queue full"] = radioQueueOverflowCounter;
+    dropped["Radio result queue full"] = radioResultOverflowCounter;
+#endif
+    JsonArray loopTime = json.createNestedArray("Loop time");
+    JsonArray latency = json.createNestedArray("Latency");
+    for (uint8_t i{0}; i < metricsHistogramBuckets; ++i)
+    {
+        loopTime.add(metrics.loopTime[i]);
+        latency.add(metrics.latency[i]);
+    }
+    json["Free heap"] = ESP.getFreeHeap();
+    json["Free heap min"] = metrics.minFreeHeap;
+    json["Max free block min"] = metrics.minMaxFreeBlock;
+#if defined(ESP32)
+    JsonObject radioTaskJson = json.createNestedObject("Radio task");
+    radioTaskJson["Core"] = radioTaskCore;
+    radioTaskJson["CPU"] = interval ? (radioTaskBusyTime - metrics.lastRadioBusyTime) / 10.0 / interval : 0; // Percent of the time since the previous metrics message.
+    radioTaskJson["Stack free"] = uxTaskGetStackHighWaterMark(radioTaskHandle);
+    JsonObject loopTaskJson = json.createNestedObject("Loop task");
+    loopTaskJson["Core"] = loopTaskCore;
+    loopTaskJson["CPU"] = interval ? (metrics.loopBusyTime - metrics.lastLoopBusyTime) / 10.0 / interval : 0;
+    loopTaskJson["Stack free"] = uxTaskGetStackHighWaterMark(loopTaskHandle);
+#endif
+    json["JSON arena exhausted"] = jsonArenaExhaustedCounter;
+    json["JSON arena oversize"] = jsonArenaOversizeCounter;
+}
+
+void buildEncodingMetrics(JsonDocument &json)
+{
+    for (uint8_t i{0}; i < encodingDeviceTypes; ++i)
+    {
+        const encoding_metrics_t &encoding = encodingMetrics[i];
+        if (!encoding.jsonFrames && !encoding.binaryFrames)
+            continue;
+        JsonObject deviceType = json.createNestedObject(getValueName((esp_now_device_type_t)i));
+        deviceType["JSON frames"] = encoding.jsonFrames;
+        deviceType["JSON bytes"] = encoding.jsonFrames ? encoding.jsonBytes / encoding.jsonFrames : 0; // Averages per frame.
+        deviceType["JSON decode"] = encoding.jsonDecodedFrames ? encoding.jsonDecodeTime / encoding.jsonDecodedFrames : 0;
+        deviceType["Binary frames"] = encoding.binaryFrames;
+        deviceType["Binary bytes"] = encoding.binaryFrames ? encoding.binaryBytes / encoding.binaryFrames : 0;
+        deviceType["Binary as JSON bytes"] = encoding.binaryFrames ? encoding.binaryJsonBytes / encoding.binaryFrames : 0;
+        deviceType["Binary decode"] = encoding.binaryFrames ? encoding.binaryDecodeTime / encoding.binaryFrames : 0;
+    }
+}
+
+void sendMetricsMessage()
+{
+    metricsMessageTimerSemaphore = false;
+    if (!isMqttAvailable)
+        return;
+    PooledJsonDocument json(2048); // For overflow protection.
+    buildMetrics(json);
+    snprintf(topicBuffer, sizeof(topicBuffer), "%s/espnow_gateway/%s/metrics", config.topicPrefix.c_str(), gatewayMac);
+    mqttPublish(topicBuffer, measureJson(json), false, writeJsonDocument, &json);
+    json.clear();
+    buildEncodingMetrics(json);
+    snprintf(topicBuffer, sizeof(topicBuffer), "%s/espnow_gateway/%s/encoding", config.topicPrefix.c_str(), gatewayMac);
+    mqttPublish(topicBuffer, measureJson(json), false, writeJsonDocument, &json);
+    metrics.lastRxTotal = 0;
+    for (uint8_t i{0}; i < metricsPayloadTypes; ++i)
+        metrics.lastRxTotal += metrics.espnowRx[i];
+    metrics.lastPublishTime = millis();
+#if defined(ESP32)
+    metrics.lastRadioBusyTime = radioTaskBusyTime;
+    metrics.lastLoopBusyTime = metrics.loopBusyTime;
+#endif
+}
+
+void queuePendingMessage(const esp_now_payload_data_t &incomingData, const uint8_t *sender, const uint32_t receivedTime)
+{
+    bool isCompactable = incomingData.payloadsType == ENPT_ATTRIBUTES || incomingData.payloadsType == ENPT_KEEP_ALIVE || incomingData.payloadsType == ENPT_STATE;
+    for (uint8_t i{0}; i < pendingQueueCount; ++i)
+    {
+        pending_message_t &pending = pendingQueue[(pendingQueueHead + i) % pendingQueueSize];
+        if (memcmp(pending.sender, sender, 6) || pending.data.deviceType != incomingData.deviceType || pending.data.payloadsType != incomingData.payloadsType)
+            continue;
+        if (isCompactable || !memcmp(pending.data.message, incomingData.message, sizeof(esp_now_payload_data_t::message)))
+        {
+            memcpy(&pending.data, &incomingData, sizeof(esp_now_payload_data_t)); // Last value wins.
+            pending.receivedTime = receivedTime;
+            return;
+        }
+    }
+    if (pendingQueueCount == pendingQueueSize)
+    {
+        if (pendingSpillCount + pendingSpillBufferCount < pendingSpillLimit)
+        {
+            if (pendingSpillBufferStart + pendingSpillBufferCount == pendingSpillBatch)
+                flushPendingSpill();
+            memcpy(&pendingSpillBuffer[pendingSpillBufferStart + pendingSpillBufferCount++], &pendingQueue[pendingQueueHead], sizeof(pending_message_t));
+        }
+        else
+            ++pendingDroppedCounter;
+        pendingQueueHead = (pendingQueueHead + 1) % pendingQueueSize;
+        --pendingQueueCount;
+    }
+    pending_message_t &pending = pendingQueue[(pendingQueueHead + pendingQueueCount) % pendingQueueSize];
+    memcpy(pending.sender, sender, 6);
+    pending.receivedTime = receivedTime;
+    memcpy(&pending.data, &incomingData, sizeof(esp_now_payload_data_t));
+    ++pendingQueueCount;
+    ++pendingQueuedCounter;
+}
+
+void flushPendingSpill()
+{
+    File file = LittleFS.open(pendingSpillFile, "a");
+    size_t length = pendingSpillBufferCount * sizeof(pending_message_t);
+    if (file && file.write((uint8_t *)&pendingSpillBuffer[pendingSpillBufferStart], length) == length)
+        pendingSpillCount += pendingSpillBufferCount;
+    else
+        pendingDroppedCounter += pendingSpillBufferCount;
+    if (file)
+        file.close();
+    pendingSpillBufferStart = 0;
+    pendingSpillBufferCount = 0;
+}
+
+void replayPendingMessages()
+{
+    if (millis() - lastPendingReplayTime < pendingReplayInterval)
+        return;
+    lastPendingReplayTime = millis();
+    File file; // Opened once per call for the spilled frames.
+    for (uint8_t i{0}; i < pendingReplayBatch && isMqttWindowOpen(); ++i)
+    {
+        pending_message_t pending;
+        if (pendingSpillCount) // Spilled frames are older than the frames in RAM.
+        {
+            if (!file)
+                file = LittleFS.open(pendingSpillFile, "r");
+            bool isRead = file && file.seek(pendingSpillReadOffset) && file.read((uint8_t *)&pending, sizeof(pending_message_t)) == sizeof(pending_message_t);
+            pendingSpillReadOffset += sizeof(pending_message_t);
+            if (--pendingSpillCount == 0)
+            {
+                if (file)
+                    file.close();
+                LittleFS.remove(pendingSpillFile);
+                pendingSpillReadOffset = 0;
+            }
+            if (!isRead)
+            {
+                ++pendingDroppedCounter;
+                continue;
+            }
+        }
+        else if (pendingSpillBufferCount)
+        {
+            memcpy(&pending, &pendingSpillBuffer[pendingSpillBufferStart++], sizeof(pending_message_t));
+            if (--pendingSpillBufferCount == 0)
+                pendingSpillBufferStart = 0;
+        }
+        else if (pendingQueueCount)
+        {
+            memcpy(&pending, &pendingQueue[pendingQueueHead], sizeof(pending_message_t));
+            pendingQueueHead = (pendingQueueHead + 1) % pendingQueueSize;
+            --pendingQueueCount;
+        }
+        else
+            return;
+        processEspnowMessage(pending.data, pending.sender, pending.receivedTime);
+        ++pendingReplayedCounter;
+    }
+    if (file)
+        file.close();
+}
+
+void handleCaptureCommand()
+{
+    uint8_t command = captureCommand;
+    captureCommand = CC_NONE;
+    if (command == CC_START && !isCaptureRunning && !isCaptureReplayRunning)
+    {
+        for (uint8_t i{0}; i < captureSegmentsCount; ++i)
+        {
+            char path[16]{0};
+            snprintf(path, sizeof(path), "/capture%u.bin", i);
+            LittleFS.remove(path);
+        }
+        captureSequence = 0;
+        captureBufferLength = 0;
+        captureFramesCounter = 0;
+        captureLastFlushTime = millis();
+        startCaptureSegment(0);
+        isCaptureRunning = true;
+    }
+    if (command == CC_STOP && isCaptureRunning)
+    {
+        flushCapture();
+        isCaptureRunning = false;
+    }
+    if ((command == CC_REPLAY_MAX_SPEED || command == CC_REPLAY_ORIGINAL_SPEED) && !isCaptureRunning && !isCaptureReplayRunning)
+        startCaptureReplay(command == CC_REPLAY_ORIGINAL_SPEED);
+}
+
+void captureFrame(const capture_direction_t direction, const esp_now_payload_data_t &data, const uint8_t *mac)
+{
+    uint8_t length = getPayloadLength(data);
+    if (captureBufferLength + sizeof(capture_record_t) + length > sizeof(captureBuffer))
+        flushCapture();
+    capture_record_t *record = (capture_record_t *)(captureBuffer + captureBufferLength);
+    record->time = millis();
+    record->direction = direction;
+    memcpy(record->mac, mac, 6);
+    record->deviceType = data.deviceType;
+    record->payloadsType = data.payloadsType;
+    record->length = length;
+    memcpy(captureBuffer + captureBufferLength + sizeof(capture_record_t), data.message, length);
+    captureBufferLength += sizeof(capture_record_t) + length;
+    ++captureFramesCounter;
+}
+
+void flushCapture()
+{
+    captureLastFlushTime = millis();
+    if (!captureBufferLength)
+        return;
+    if (captureSegmentLength + captureBufferLength > captureSegmentSize)
+        startCaptureSegment((captureSegment + 1) % captureSegmentsCount);
+    char path[16]{0};
+    snprintf(path, sizeof(path), "/capture%u.bin", captureSegment);
+    File file = LittleFS.open(path, "a");
+    if (file)
+    {
+        file.write(captureBuffer, captureBufferLength);
+        file.close();
+        captureSegmentLength += captureBufferLength;
+    }
+    captureBufferLength = 0;
 }
 
-void mqttAvailabilityCheckTimerCallback()
+void startCaptureSegment(const uint8_t index)
 {
-    mqttAvailabilityCheckTimerSemaphore = true;
+    captureSegment = index;
+    capture_segment_header_t header{captureMagic, captureVersion, ++captureSequence};
+    char path[16]{0};
+    snprintf(path, sizeof(path), "/capture%u.bin", index);
+    File file = LittleFS.open(path, "w");
+    if (!file)
+        return;
+    file.write((const uint8_t *)&header, sizeof(header));
+    file.close();
+    captureSegmentLength = sizeof(header);
+}
+
+void startCaptureReplay(const bool isOriginalSpeed)
+{
+    uint32_t sequences[captureSegmentsCount]{0};
+    captureReplayOrderCount = 0;
+    for (uint8_t i{0}; i < captureSegmentsCount; ++i)
+    {
+        char path[16]{0};
+        snprintf(path, sizeof(path), "/capture%u.bin", i);
+        File file = LittleFS.open(path, "r");
+        if (!file)
+            continue;
+        capture_segment_header_t header;
+        bool isValid = file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) && header.magic == captureMagic && header.version == captureVersion;
+        file.close();
+        if (!isValid)
+            continue;
+        uint8_t position = captureReplayOrderCount++; // Insertion sort by sequence.
+        while (position && sequences[position - 1] > header.sequence)
+        {
+            sequences[position] = sequences[position - 1];
+            captureReplayOrder[position] = captureReplayOrder[position - 1];
+            --position;
+        }
+        sequences[position] = header.sequence;
+        captureReplayOrder[position] = i;
+    }
+    if (!captureReplayOrderCount)
+        return;
+    captureReplayIndex = 0;
+    captureReplayFrames = 0;
+    captureReplayBusyTime = 0;
+    captureReplayDuration = 0;
+    captureReplayFirstTime = 0;
+    isCaptureRecordPending = false;
+    isCaptureReplayOriginalSpeed = isOriginalSpeed;
+    captureReplayStartTime = millis();
+    isCaptureReplayRunning = true;
+}
+
+void replayCaptureFrames()
+{
+    for (uint8_t i{0}; i < captureReplayBatch; ++i)
+    {
+        if (!isCaptureRecordPending)
+        {
+            if (!readCaptureRecord())
+            {
+                if (captureReplayFile)
+                    captureReplayFile.close();
+                captureReplayDuration = millis() - captureReplayStartTime;
+                isCaptureReplayRunning = false;
+                return;
+            }
+            if (!captureReplayFirstTime)
+                captureReplayFirstTime = captureReplayRecord.time;
+            isCaptureRecordPending = true;
+        }
+        if (isCaptureReplayOriginalSpeed && captureReplayRecord.time - captureReplayFirstTime > millis() - captureReplayStartTime)
+            return;
+        isCaptureRecordPending = false;
+        if (captureReplayRecord.direction != CD_RX)
+            continue;
+        esp_now_payload_data_t data;
+        data.deviceType = (esp_now_device_type_t)captureReplayRecord.deviceType;
+        data.payloadsType = (esp_now_payload_type_t)captureReplayRecord.payloadsType;
+        memset(&data.message, 0, sizeof(esp_now_payload_data_t::message));
+        memcpy(&data.message, captureReplayMessage, captureReplayRecord.length);
+        uint32_t startTime = micros();
+        isBenchmarkRunning = !isCaptureReplayOriginalSpeed;
+        processEspnowMessage(data, captureReplayRecord.mac, 0, true);
+        isBenchmarkRunning = false;
+        captureReplayBusyTime += micros() - startTime;
+        ++captureReplayFrames;
+    }
+}
+
+bool readCaptureRecord()
+{
+    while (captureReplayIndex < captureReplayOrderCount || captureReplayFile)
+    {
+        if (!captureReplayFile)
+        {
+            char path[16]{0};
+            snprintf(path, sizeof(path), "/capture%u.bin", captureReplayOrder[captureReplayIndex++]);
+            captureReplayFile = LittleFS.open(path, "r");
+            if (!captureReplayFile || !captureReplayFile.seek(sizeof(capture_segment_header_t)))
+                continue;
+        }
+        if (captureReplayFile.read((uint8_t *)&captureReplayRecord, sizeof(capture_record_t)) == sizeof(capture_record_t) &&
+            captureReplayRecord.length <= sizeof(captureReplayMessage) &&
+            captureReplayFile.read((uint8_t *)captureReplayMessage, captureReplayRecord.length) == captureReplayRecord.length)
+            return true;
+        captureReplayFile.close(); // End of the segment.
+    }
+    return false;
 }
 
 void keepAliveMessageTimerCallback()
@@ -729,6 +2900,16 @@ void keepAliveMessageTimerCallback()
     keepAliveMessageTimerSemaphore = true;
 }
 
+void metricsMessageTimerCallback()
+{
+    metricsMessageTimerSemaphore = true;
+}
+
+void availabilityCheckTimerCallback()
+{
+    availabilityCheckTimerSemaphore = true;
+}
+
 void attributesMessageTimerCallback()
 {
     attributesMessageTimerSemaphore = true;
@@ -0,0 +1,596 @@
+#include "message_path.h"
+
+device_entry_t deviceRegistry[deviceRegistrySize];
+#if defined(ESP32)
+SemaphoreHandle_t deviceRegistryMutex{nullptr}; // Held by loop() while an entry is replaced and by the /devices handler while it copies one.
+#endif
+uint8_t deviceRegistryCount{0};
+device_entry_t replayedDevice; // Topic root of the last replayed frame. Never part of the registry.
+char topicBuffer[128]{0};
+char discoveryTopicBuffer[128]{0};
+char uniqueIdBuffer[20]{0}; // "<12 hex>-<unit>" with a unit up to 255.
+
+value_name_t valueNames[valueNamesSize];
+uint8_t valueNamesCount{0};
+char valueNameBuffer[32]{0}; // Used when the table is full.
+
+const discovery_field_t switchDiscoveryFields[]{
+    {"platform", DFK_TEXT, "mqtt", DFC_ALWAYS},
+    {"name", DFK_COPY, MCMT_DEVICE_NAME, DFC_ALWAYS},
+    {"unique_id", DFK_UNIQUE_ID, nullptr, DFC_ALWAYS},
+    {"device_class", DFK_SWITCH_CLASS, nullptr, DFC_ALWAYS},
+    {"state_topic", DFK_TOPIC, "state", DFC_ALWAYS},
+    {"value_template", DFK_VALUE_TEMPLATE, nullptr, DFC_ALWAYS},
+    {"command_topic", DFK_TOPIC, "set", DFC_ALWAYS},
+    {"json_attributes_topic", DFK_TOPIC, "attributes", DFC_ALWAYS},
+    {"availability_topic", DFK_TOPIC, "status", DFC_ALWAYS},
+    {"payload_on", DFK_COPY, MCMT_PAYLOAD_ON, DFC_ALWAYS},
+    {"payload_off", DFK_COPY, MCMT_PAYLOAD_OFF, DFC_ALWAYS},
+    {"optimistic", DFK_TEXT, "false", DFC_ALWAYS},
+    {"retain", DFK_TEXT, "true", DFC_ALWAYS}};
+
+const discovery_field_t ledDiscoveryFields[]{
+    {"platform", DFK_TEXT, "mqtt", DFC_ALWAYS},
+    {"name", DFK_COPY, MCMT_DEVICE_NAME, DFC_ALWAYS},
+    {"unique_id", DFK_UNIQUE_ID, nullptr, DFC_ALWAYS},
+    {"state_topic", DFK_TOPIC, "state", DFC_ALWAYS},
+    {"state_value_template", DFK_TEXT, "{{ value_json.state }}", DFC_ALWAYS},
+    {"command_topic", DFK_TOPIC, "set", DFC_ALWAYS},
+    {"brightness_state_topic", DFK_TOPIC, "state", DFC_ALWAYS},
+    {"brightness_value_template", DFK_TEXT, "{{ value_json.brightness }}", DFC_ALWAYS},
+    {"brightness_command_topic", DFK_TOPIC, "brightness", DFC_ALWAYS},
+    {"rgb_state_topic", DFK_TOPIC, "state", DFC_LED_RGB},
+    {"rgb_value_template", DFK_TEXT, "{{ value_json.rgb | join(',') }}", DFC_LED_RGB},
+    {"rgb_command_topic", DFK_TOPIC, "rgb", DFC_LED_RGB},
+    {"color_temp_state_topic", DFK_TOPIC, "state", DFC_LED_WW},
+    {"color_temp_value_template", DFK_TEXT, "{{ value_json.temperature }}", DFC_LED_WW},
+    {"color_temp_command_topic", DFK_TOPIC, "temperature", DFC_LED_WW},
+    {"json_attributes_topic", DFK_TOPIC, "attributes", DFC_ALWAYS},
+    {"availability_topic", DFK_TOPIC, "status", DFC_ALWAYS},
+    {"payload_on", DFK_COPY, MCMT_PAYLOAD_ON, DFC_ALWAYS},
+    {"payload_off", DFK_COPY, MCMT_PAYLOAD_OFF, DFC_ALWAYS},
+    {"optimistic", DFK_TEXT, "false", DFC_ALWAYS},
+    {"retain", DFK_TEXT, "true", DFC_ALWAYS}};
+
+const discovery_field_t sensorDiscoveryFields[]{
+    {"platform", DFK_TEXT, "mqtt", DFC_ALWAYS},
+    {"name", DFK_COPY, MCMT_DEVICE_NAME, DFC_ALWAYS},
+    {"unique_id", DFK_UNIQUE_ID, nullptr, DFC_ALWAYS},
+    {"state_topic", DFK_TOPIC, "state", DFC_ALWAYS},
+    {"value_template", DFK_VALUE_TEMPLATE, nullptr, DFC_ALWAYS},
+    {"json_attributes_topic", DFK_TOPIC, "attributes", DFC_ALWAYS},
+    {"force_update", DFK_TEXT, "true", DFC_ALWAYS},
+    {"retain", DFK_TEXT, "true", DFC_ALWAYS},
+    {"device_class", DFK_SENSOR_CLASS, nullptr, DFC_SENSOR},
+    {"unit_of_measurement", DFK_COPY, MCMT_UNIT_OF_MEASUREMENT, DFC_SENSOR},
+    {"device_class", DFK_BINARY_SENSOR_CLASS, nullptr, DFC_BINARY_SENSOR},
+    {"expire_after", DFK_COPY, MCMT_EXPIRE_AFTER, DFC_ALWAYS},
+    {"off_delay", DFK_COPY, MCMT_OFF_DELAY, DFC_ALWAYS},
+    {"payload_on", DFK_COPY, MCMT_PAYLOAD_ON, DFC_ALWAYS},
+    {"payload_off", DFK_COPY, MCMT_PAYLOAD_OFF, DFC_ALWAYS}};
+
+const discovery_field_t rfSensorDiscoveryFields[]{
+    {"platform", DFK_TEXT, "mqtt", DFC_ALWAYS},
+    {"name", DFK_RF_SENSOR_NAME, nullptr, DFC_ALWAYS},
+    {"unique_id", DFK_UNIQUE_ID, nullptr, DFC_ALWAYS},
+    {"state_topic", DFK_RF_SENSOR_TOPIC, nullptr, DFC_ALWAYS},
+    {"value_template", DFK_VALUE_TEMPLATE, nullptr, DFC_ALWAYS},
+    {"force_update", DFK_TEXT, "true", DFC_ALWAYS},
+    {"retain", DFK_TEXT, "true", DFC_ALWAYS},
+    {"device_class", DFK_SENSOR_CLASS, nullptr, DFC_SENSOR},
+    {"unit_of_measurement", DFK_COPY, MCMT_UNIT_OF_MEASUREMENT, DFC_SENSOR},
+    {"device_class", DFK_BINARY_SENSOR_CLASS, nullptr, DFC_BINARY_SENSOR},
+    {"expire_after", DFK_COPY, MCMT_EXPIRE_AFTER, DFC_ALWAYS},
+    {"off_delay", DFK_COPY, MCMT_OFF_DELAY, DFC_ALWAYS},
+    {"payload_on", DFK_COPY, MCMT_PAYLOAD_ON, DFC_ALWAYS},
+    {"payload_off", DFK_COPY, MCMT_PAYLOAD_OFF, DFC_ALWAYS}};
+
+const discovery_field_t rfGatewayDiscoveryFields[]{
+    {"platform", DFK_TEXT, "mqtt", DFC_ALWAYS},
+    {"name", DFK_COPY, MCMT_DEVICE_NAME, DFC_ALWAYS},
+    {"unique_id", DFK_UNIQUE_ID, nullptr, DFC_ALWAYS},
+    {"device_class", DFK_BINARY_SENSOR_CLASS, nullptr, DFC_ALWAYS},
+    {"state_topic", DFK_TOPIC, "status", DFC_ALWAYS},
+    {"json_attributes_topic", DFK_TOPIC, "attributes", DFC_ALWAYS},
+    {"payload_on", DFK_COPY, MCMT_PAYLOAD_ON, DFC_ALWAYS},
+    {"expire_after", DFK_COPY, MCMT_EXPIRE_AFTER, DFC_ALWAYS},
+    {"force_update", DFK_TEXT, "true", DFC_ALWAYS},
+    {"retain", DFK_TEXT, "true", DFC_ALWAYS}};
+
+#define DISCOVERY_FIELDS(fields) fields, sizeof(fields) / sizeof(fields[0])
+
+const discovery_descriptor_t discoveryDescriptors[]{
+    {ENDT_SWITCH, DISCOVERY_FIELDS(switchDiscoveryFields), false},
+    {ENDT_LED, DISCOVERY_FIELDS(ledDiscoveryFields), false},
+    {ENDT_SENSOR, DISCOVERY_FIELDS(sensorDiscoveryFields), false},
+    {ENDT_RF_SENSOR, DISCOVERY_FIELDS(rfSensorDiscoveryFields), true},
+    {ENDT_RF_GATEWAY, DISCOVERY_FIELDS(rfGatewayDiscoveryFields), false}};
+
+typedef struct
+{
+    uint32_t topicHash{0};
+    uint32_t payloadHash{0};
+} discovery_hash_t;
+
+const uint8_t discoveryCacheSize{48};
+
+discovery_hash_t discoveryCache[discoveryCacheSize];
+uint8_t discoveryCacheCount{0};
+uint8_t discoveryCacheNext{0};
+
+coalesce_slot_t coalesceSlots[coalesceSlotsSize];
+token_bucket_t coalesceGlobalBucket{coalesceGlobalBurst * 1000, 0};
+uint8_t coalescePendingCount{0};
+uint32_t coalesceMergedCounter{0}; // Values replaced by a newer one before being published.
+uint32_t coalesceSuppressedCounter{0}; // Values held back by the window or the rate limits on arrival.
+uint32_t coalesceBypassedCounter{0}; // Values published directly because all slots were pending or the topic did not fit a slot.
+
+encoding_metrics_t encodingMetrics[encodingDeviceTypes];
+
+alignas(8) uint8_t jsonSmallArenas[4][jsonSmallArenaSize];
+alignas(8) uint8_t jsonMediumArenas[2][jsonMediumArenaSize];
+alignas(8) uint8_t jsonLargeArenas[1][jsonLargeArenaSize];
+
+json_arena_t jsonArenas[]{ // Sorted by size. The smallest free arena that fits is used.
+    {jsonSmallArenas[0], jsonSmallArenaSize, {false}},
+    {jsonSmallArenas[1], jsonSmallArenaSize, {false}},
+    {jsonSmallArenas[2], jsonSmallArenaSize, {false}},
+    {jsonSmallArenas[3], jsonSmallArenaSize, {false}},
+    {jsonMediumArenas[0], jsonMediumArenaSize, {false}},
+    {jsonMediumArenas[1], jsonMediumArenaSize, {false}},
+    {jsonLargeArenas[0], jsonLargeArenaSize, {false}}};
+uint32_t jsonArenaExhaustedCounter{0}; // Fitting arenas were all in use, the document was allocated on the heap.
+uint32_t jsonArenaOversizeCounter{0}; // Document larger than any arena, allocated on the heap.
+
+bool isBenchmarkRunning{false}; // Coalescing is bypassed and main.cpp does not send. Set by the capture replay at maximum speed and the host benchmark.
+uint32_t publishedFrameReceivedTime{0}; // Receive time of the frame whose message mqttPublish() is called for. 0 if no latency is recorded.
+
+void processEspnowMessage(const esp_now_payload_data_t &incomingData, const uint8_t *sender, const uint32_t receivedTime, const bool isReplayed)
+{
+    publishedFrameReceivedTime = isReplayed ? 0 : receivedTime; // Coalesced messages keep it in their slot until they are published.
+    publishEspnowMessage(incomingData, sender, isReplayed);
+    publishedFrameReceivedTime = 0;
+}
+
+void publishEspnowMessage(const esp_now_payload_data_t &incomingData, const uint8_t *sender, const bool isReplayed)
+{
+    bool isBinary = isBinaryPayload(incomingData);
+    if (incomingData.payloadsType == ENPT_ATTRIBUTES || incomingData.payloadsType == ENPT_STATE || incomingData.payloadsType == ENPT_CONFIG || incomingData.payloadsType == ENPT_FORWARD)
+    {
+        encoding_metrics_t &encoding = encodingMetrics[incomingData.deviceType % encodingDeviceTypes];
+        if (isBinary)
+        {
+            ++encoding.binaryFrames;
+            encoding.binaryBytes += getPayloadLength(incomingData);
+        }
+        else
+        {
+            ++encoding.jsonFrames;
+            encoding.jsonBytes += getPayloadLength(incomingData);
+        }
+    }
+    if (incomingData.payloadsType == ENPT_ATTRIBUTES || incomingData.payloadsType == ENPT_STATE)
+    {
+        const char *suffix = incomingData.payloadsType == ENPT_STATE ? "state" : "attributes";
+        if (!isBinary)
+        {
+            if (incomingData.payloadsType == ENPT_STATE)
+                publishCoalesced(buildDeviceTopic(sender, incomingData.deviceType, suffix, isReplayed), incomingData.message, !isReplayed);
+            else
+                mqttPublish(buildDeviceTopic(sender, incomingData.deviceType, suffix, isReplayed), incomingData.message, !isReplayed);
+            return;
+        }
+        char message[sizeof(esp_now_payload_data_t::message)];
+        PooledJsonDocument json(binaryPayloadCapacity);
+        if (decodePayload(incomingData, json, message))
+            publishTranscodedPayload(buildDeviceTopic(sender, incomingData.deviceType, suffix, isReplayed), json, !isReplayed, incomingData.payloadsType == ENPT_STATE);
+    }
+    if (incomingData.payloadsType == ENPT_KEEP_ALIVE)
+        mqttPublish(buildDeviceTopic(sender, incomingData.deviceType, "status", isReplayed), "online", !isReplayed);
+    if (incomingData.payloadsType == ENPT_CONFIG)
+    {
+        const discovery_descriptor_t *descriptor = getDiscoveryDescriptor(incomingData.deviceType);
+        if (!descriptor)
+            return;
+        char message[sizeof(esp_now_payload_data_t::message)];
+        PooledJsonDocument json(isBinary ? binaryPayloadCapacity : sizeof(esp_now_payload_data_t::message));
+        decodePayload(incomingData, json, message);
+        uint8_t unit = json[MCMT_DEVICE_UNIT].as<uint8_t>();
+        if (descriptor->isRfSensor)
+            snprintf(uniqueIdBuffer, sizeof(uniqueIdBuffer), "%u-%u", json[MCMT_RF_SENSOR_ID].as<uint16_t>(), unit);
+        else
+            buildUniqueId(sender, incomingData.deviceType, unit, isReplayed);
+        discovery_context_t context{descriptor, &json, incomingData.deviceType, sender, isReplayed};
+        publishDiscoveryMessage(buildDiscoveryTopic(getCachedValueName(json[MCMT_COMPONENT_TYPE].as<ha_component_type_t>()), uniqueIdBuffer, isReplayed), writeDiscoveryContext, &context, isReplayed);
+    }
+    if (incomingData.payloadsType == ENPT_FORWARD)
+    {
+        char message[sizeof(esp_now_payload_data_t::message)];
+        PooledJsonDocument json(isBinary ? binaryPayloadCapacity : sizeof(esp_now_payload_data_t::message));
+        decodePayload(incomingData, json, message);
+        if (incomingData.deviceType != ENDT_RF_GATEWAY)
+            return;
+        const char *topic = buildRfSensorTopic(json["type"].as<rf_sensor_type_t>(), json["id"].as<uint16_t>(), isReplayed);
+        if (isBinary)
+            publishTranscodedPayload(topic, json, false, true);
+        else
+            publishCoalesced(topic, incomingData.message, false);
+    }
+}
+
+bool isBinaryPayload(const esp_now_payload_data_t &data)
+{
+    return (uint8_t)data.message[0] == binaryPayloadMarker;
+}
+
+uint8_t getPayloadLength(const esp_now_payload_data_t &data)
+{
+    if (!isBinaryPayload(data))
+        return strnlen(data.message, sizeof(esp_now_payload_data_t::message));
+    uint8_t length = 2 + (uint8_t)data.message[1]; // Marker, MessagePack length and MessagePack data. May contain zero bytes.
+    return length < sizeof(esp_now_payload_data_t::message) ? length : sizeof(esp_now_payload_data_t::message);
+}
+
+bool decodePayload(const esp_now_payload_data_t &data, JsonDocument &json, char *message)
+{
+    uint32_t startTime = micros();
+    memcpy(message, data.message, sizeof(esp_now_payload_data_t::message)); // Zero-copy decoding rewrites the buffer.
+    encoding_metrics_t &encoding = encodingMetrics[data.deviceType % encodingDeviceTypes];
+    if (!isBinaryPayload(data))
+    {
+        bool isDecoded = !deserializeJson(json, message);
+        encoding.jsonDecodeTime += micros() - startTime;
+        ++encoding.jsonDecodedFrames;
+        return isDecoded;
+    }
+    bool isDecoded = !deserializeMsgPack(json, message + 2, getPayloadLength(data) - 2);
+    encoding.binaryDecodeTime += micros() - startTime;
+    if (isDecoded)
+        encoding.binaryJsonBytes += measureJson(json);
+    return isDecoded;
+}
+
+void publishTranscodedPayload(const char *topic, JsonDocument &json, bool retained, bool isCoalesced)
+{
+    size_t length = measureJson(json);
+    if (!isCoalesced || length >= sizeof(coalesce_slot_t::payload))
+    {
+        mqttPublish(topic, length, retained, writeJsonDocument, &json); // Streamed, may be larger than an ESP-NOW message.
+        return;
+    }
+    char payload[sizeof(coalesce_slot_t::payload)]{0};
+    serializeJson(json, payload, sizeof(payload));
+    publishCoalesced(topic, payload, retained);
+}
+
+void writeJsonDocument(Print &output, const void *context)
+{
+    serializeJson(*(const JsonDocument *)context, output);
+}
+
+void writeDiscoveryContext(Print &output, const void *context)
+{
+    const discovery_context_t *discovery = (const discovery_context_t *)context;
+    writeDiscoveryPayload(output, *discovery->descriptor, *discovery->json, discovery->deviceType, discovery->sender, discovery->isReplayed);
+}
+
+device_entry_t *getDevice(const uint8_t *mac, const esp_now_device_type_t deviceType, const bool isReplayed)
+{
+    if (isReplayed) // Replayed frames must not create or evict entries of live devices.
+    {
+        if (memcmp(replayedDevice.mac, mac, 6) || replayedDevice.deviceType != deviceType)
+            initDeviceEntry(replayedDevice, mac, deviceType);
+        return &replayedDevice;
+    }
+    device_entry_t *oldest{nullptr};
+    for (uint8_t i{0}; i < deviceRegistryCount; ++i)
+    {
+        device_entry_t &device = deviceRegistry[i];
+        if (!memcmp(device.mac, mac, 6) && device.deviceType == deviceType)
+        {
+            device.lastUsedTime = millis();
+            return &device;
+        }
+        if (!oldest || (int32_t)(device.lastUsedTime - oldest->lastUsedTime) < 0)
+            oldest = &device;
+    }
+#if defined(ESP32)
+    xSemaphoreTake(deviceRegistryMutex, portMAX_DELAY);
+#endif
+    device_entry_t &device = deviceRegistryCount < deviceRegistrySize ? deviceRegistry[deviceRegistryCount++] : *oldest;
+    initDeviceEntry(device, mac, deviceType);
+#if defined(ESP32)
+    xSemaphoreGive(deviceRegistryMutex);
+#endif
+    return &device;
+}
+
+void initDeviceEntry(device_entry_t &device, const uint8_t *mac, const esp_now_device_type_t deviceType)
+{
+    device = device_entry_t();
+    device.lastUsedTime = millis();
+    memcpy(device.mac, mac, 6);
+    device.deviceType = deviceType;
+    snprintf(device.macHex, sizeof(device.macHex), "%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    snprintf(device.root, sizeof(device.root), "%s/%s", getCachedValueName(deviceType), device.macHex);
+}
+
+const char *getReplayTopicSuffix(const bool isReplayed)
+{
+    return isReplayed ? replayTopicSuffix : "";
+}
+
+char *buildDeviceTopic(const uint8_t *mac, const esp_now_device_type_t deviceType, const char *suffix, const bool isReplayed)
+{
+    snprintf(topicBuffer, sizeof(topicBuffer), "%s%s/%s/%s", getTopicPrefix(), getReplayTopicSuffix(isReplayed), getDevice(mac, deviceType, isReplayed)->root, suffix);
+    return topicBuffer;
+}
+
+char *buildUniqueId(const uint8_t *mac, const esp_now_device_type_t deviceType, const uint8_t unit, const bool isReplayed)
+{
+    snprintf(uniqueIdBuffer, sizeof(uniqueIdBuffer), "%s-%u", getDevice(mac, deviceType, isReplayed)->macHex, unit);
+    return uniqueIdBuffer;
+}
+
+char *buildDiscoveryTopic(const char *component, const char *uniqueId, const bool isReplayed)
+{
+    snprintf(discoveryTopicBuffer, sizeof(discoveryTopicBuffer), "%s%s/%s/%s/config", getTopicPrefix(), getReplayTopicSuffix(isReplayed), component, uniqueId);
+    return discoveryTopicBuffer;
+}
+
+char *buildRfSensorTopic(const rf_sensor_type_t type, const uint16_t id, const bool isReplayed)
+{
+    snprintf(topicBuffer, sizeof(topicBuffer), "%s%s/rf_sensor/%s/%u/state", getTopicPrefix(), getReplayTopicSuffix(isReplayed), getCachedValueName(type), id);
+    return topicBuffer;
+}
+
+const discovery_descriptor_t *getDiscoveryDescriptor(const esp_now_device_type_t deviceType)
+{
+    for (const discovery_descriptor_t &descriptor : discoveryDescriptors)
+        if (descriptor.deviceType == deviceType)
+            return &descriptor;
+    return nullptr;
+}
+
+void writeDiscoveryPayload(Print &output, const discovery_descriptor_t &descriptor, JsonDocument &json, const esp_now_device_type_t deviceType, const uint8_t *sender, const bool isReplayed)
+{
+    ha_component_type_t componentType = json[MCMT_COMPONENT_TYPE].as<ha_component_type_t>();
+    esp_now_led_type_t ledClass = json[MCMT_DEVICE_CLASS].as<esp_now_led_type_t>();
+    char value[96]{0};
+    bool isFirst{true};
+    output.write('{');
+    for (uint8_t i{0}; i < descriptor.fieldsCount; ++i)
+    {
+        const discovery_field_t &field = descriptor.fields[i];
+        if ((field.condition == DFC_LED_RGB && ledClass != ENLT_RGB && ledClass != ENLT_RGBW && ledClass != ENLT_RGBWW) ||
+            (field.condition == DFC_LED_WW && ledClass != ENLT_WW && ledClass != ENLT_RGBWW) ||
+            (field.condition == DFC_SENSOR && componentType != HACT_SENSOR) ||
+            (field.condition == DFC_BINARY_SENSOR && componentType != HACT_BINARY_SENSOR))
+            continue;
+        if (field.kind == DFK_COPY && !json[field.value])
+            continue;
+        if (!isFirst)
+            output.write(',');
+        isFirst = false;
+        writeJsonString(output, field.key);
+        output.write(':');
+        switch (field.kind)
+        {
+        case DFK_TEXT:
+            writeJsonString(output, field.value);
+            break;
+        case DFK_COPY:
+            serializeJson(json[field.value], output);
+            break;
+        case DFK_TOPIC:
+            writeJsonString(output, buildDeviceTopic(sender, deviceType, field.value, isReplayed));
+            break;
+        case DFK_VALUE_TEMPLATE:
+            snprintf(value, sizeof(value), "{{ value_json.%s }}", json[MCMT_VALUE_TEMPLATE] | "");
+            writeJsonString(output, value);
+            break;
+        case DFK_UNIQUE_ID:
+            writeJsonString(output, uniqueIdBuffer);
+            break;
+        case DFK_SWITCH_CLASS:
+            writeJsonString(output, getCachedValueName(json[MCMT_DEVICE_CLASS].as<ha_switch_device_class_t>()));
+            break;
+        case DFK_SENSOR_CLASS:
+            writeJsonString(output, getCachedValueName(json[MCMT_DEVICE_CLASS].as<ha_sensor_device_class_t>()));
+            break;
+        case DFK_BINARY_SENSOR_CLASS:
+            writeJsonString(output, getCachedValueName(json[MCMT_DEVICE_CLASS].as<ha_binary_sensor_device_class_t>()));
+            break;
+        case DFK_RF_SENSOR_NAME:
+            snprintf(value, sizeof(value), "%s %u %s", getCachedValueName(json[MCMT_RF_SENSOR_TYPE].as<rf_sensor_type_t>()), json[MCMT_RF_SENSOR_ID].as<uint16_t>(), json[MCMT_VALUE_TEMPLATE] | "");
+            writeJsonString(output, value);
+            break;
+        case DFK_RF_SENSOR_TOPIC:
+            writeJsonString(output, buildRfSensorTopic(json[MCMT_RF_SENSOR_TYPE].as<rf_sensor_type_t>(), json[MCMT_RF_SENSOR_ID].as<uint16_t>(), isReplayed));
+            break;
+        default:
+            break;
+        }
+    }
+    output.write('}');
+}
+
+void writeJsonString(Print &output, const char *value)
+{
+    output.write('"');
+    for (; value && *value; ++value)
+    {
+        if (*value == '"' || *value == '\\')
+            output.write('\\');
+        if ((uint8_t)*value < 0x20)
+        {
+            char escaped[7];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", (uint8_t)*value);
+            output.print(escaped);
+            continue;
+        }
+        output.write((uint8_t)*value);
+    }
+    output.write('"');
+}
+
+uint32_t getHash(const char *data, uint32_t hash)
+{
+    while (*data)
+        hash = (hash ^ (uint8_t)*data++) * 16777619; // FNV-1a.
+    return hash;
+}
+
+void publishDiscoveryMessage(const char *topic, payload_writer_t writer, const void *context, const bool isReplayed)
+{
+    uint32_t topicHash = getHash(topic);
+    hashPrint payload; // First pass: payload length and hash.
+    writer(payload, context);
+    if (isReplayed || isBenchmarkRunning) // Nothing is published to the live topics, so the cache must not record it.
+    {
+        mqttPublish(topic, payload.length, !isReplayed, writer, context);
+        return;
+    }
+    for (uint8_t i{0}; i < discoveryCacheCount; ++i)
+        if (discoveryCache[i].topicHash == topicHash)
+        {
+            if (discoveryCache[i].payloadHash == payload.hash)
+                return;
+            discoveryCache[i].payloadHash = payload.hash;
+            mqttPublish(topic, payload.length, true, writer, context);
+            return;
+        }
+    discoveryCache[discoveryCacheNext].topicHash = topicHash;
+    discoveryCache[discoveryCacheNext].payloadHash = payload.hash;
+    discoveryCacheNext = (discoveryCacheNext + 1) % discoveryCacheSize;
+    if (discoveryCacheCount < discoveryCacheSize)
+        ++discoveryCacheCount;
+    mqttPublish(topic, payload.length, true, writer, context);
+}
+
+void publishCoalesced(const char *topic, const char *payload, bool retained)
+{
+    if (isBenchmarkRunning)
+    {
+        mqttPublish(topic, payload, retained);
+        return;
+    }
+    if (strlen(topic) >= sizeof(coalesce_slot_t::topic) || strlen(payload) >= sizeof(coalesce_slot_t::payload)) // Would be truncated in the slot.
+    {
+        ++coalesceBypassedCounter;
+        mqttPublish(topic, payload, retained);
+        return;
+    }
+    uint32_t topicHash = getHash(topic);
+    coalesce_slot_t *slot{nullptr};
+    for (coalesce_slot_t &candidate : coalesceSlots)
+        if (candidate.topicHash == topicHash)
+        {
+            slot = &candidate;
+            break;
+        }
+    if (!slot)
+    {
+        for (coalesce_slot_t &candidate : coalesceSlots)
+            if (!candidate.isPending && (!slot || (int32_t)(candidate.lastPublishTime - slot->lastPublishTime) < 0))
+                slot = &candidate;
+        if (!slot)
+        {
+            ++coalesceBypassedCounter;
+            mqttPublish(topic, payload, retained);
+            return;
+        }
+        slot->topicHash = topicHash;
+        strncpy(slot->topic, topic, sizeof(slot->topic) - 1);
+        slot->lastPublishTime = millis() - coalesceWindow;
+        slot->bucket.tokens = coalesceDeviceBurst * 1000;
+        slot->bucket.lastRefillTime = millis();
+    }
+    strncpy(slot->payload, payload, sizeof(slot->payload) - 1);
+    slot->retained = retained;
+    slot->receivedTime = publishedFrameReceivedTime;
+    if (slot->isPending)
+    {
+        ++coalesceMergedCounter;
+        return;
+    }
+    slot->isPending = true;
+    ++coalescePendingCount;
+    if (!publishCoalescedSlot(*slot))
+        ++coalesceSuppressedCounter;
+}
+
+bool publishCoalescedSlot(coalesce_slot_t &slot)
+{
+    if (millis() - slot.lastPublishTime < coalesceWindow)
+        return false;
+    bool isDeviceToken = refillTokenBucket(slot.bucket, coalesceDeviceRate, coalesceDeviceBurst);
+    bool isGlobalToken = refillTokenBucket(coalesceGlobalBucket, coalesceGlobalRate, coalesceGlobalBurst);
+    if (!isDeviceToken || !isGlobalToken)
+        return false;
+    slot.bucket.tokens -= 1000;
+    coalesceGlobalBucket.tokens -= 1000;
+    slot.lastPublishTime = millis();
+    slot.isPending = false;
+    --coalescePendingCount;
+    uint32_t frameReceivedTime = publishedFrameReceivedTime; // Set while a frame is processed, 0 when flushed from loop().
+    publishedFrameReceivedTime = slot.receivedTime;
+    mqttPublish(slot.topic, slot.payload, slot.retained);
+    publishedFrameReceivedTime = frameReceivedTime;
+    return true;
+}
+
+void flushCoalescedStates()
+{
+    for (coalesce_slot_t &slot : coalesceSlots)
+        if (slot.isPending)
+            publishCoalescedSlot(slot); // The latest value always goes out once the window and tokens allow.
+}
+
+bool refillTokenBucket(token_bucket_t &bucket, const uint8_t rate, const uint8_t burst)
+{
+    uint32_t elapsed = millis() - bucket.lastRefillTime;
+    bucket.lastRefillTime += elapsed;
+    if (elapsed > 60000) // Overflow protection. The bucket is full long before.
+        elapsed = 60000;
+    bucket.tokens += elapsed * rate; // Thousandths of a token per millisecond.
+    if (bucket.tokens > burst * 1000U)
+        bucket.tokens = burst * 1000U;
+    return bucket.tokens >= 1000;
+}
+
+void *PooledJsonAllocator::allocate(size_t size)
+{
+    bool isFitting{false};
+    for (json_arena_t &arena : jsonArenas)
+    {
+        if (arena.size < size)
+            continue;
+        isFitting = true;
+        bool isUsed{false};
+        if (arena.isUsed.compare_exchange_strong(isUsed, true)) // Web server handlers may run on another task on ESP32.
+            return arena.memory;
+    }
+    if (isFitting)
+        ++jsonArenaExhaustedCounter;
+    else
+        ++jsonArenaOversizeCounter;
+    return malloc(size);
+}
+void PooledJsonAllocator::deallocate(void *pointer)
+{
+    for (json_arena_t &arena : jsonArenas)
+        if (arena.memory == pointer)
+        {
+            arena.isUsed.store(false);
+            return;
+        }
+    free(pointer);
+}
+void *PooledJsonAllocator::reallocate(void *pointer, size_t size)
+{
+    for (json_arena_t &arena : jsonArenas)
+        if (arena.memory == pointer)
+            return size <= arena.size ? pointer : nullptr;
+    return realloc(pointer, size);
+}
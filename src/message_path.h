@@ -0,0 +1,263 @@
+#pragma once
+
+#include "Arduino.h"
+#include "ArduinoJson.h"
+#include "ZHConfig.h"
+#include <atomic>
+
+// ESP-NOW frame to MQTT message path. Built into the firmware and into the host program (env:native), which has no radio, broker or flash.
+
+typedef enum : uint8_t
+{
+    DFK_TEXT, // Literal value.
+    DFK_COPY, // Value of the device config key, skipped if not set.
+    DFK_TOPIC, // Device topic with the given suffix.
+    DFK_VALUE_TEMPLATE,
+    DFK_UNIQUE_ID,
+    DFK_SWITCH_CLASS,
+    DFK_SENSOR_CLASS,
+    DFK_BINARY_SENSOR_CLASS,
+    DFK_RF_SENSOR_NAME,
+    DFK_RF_SENSOR_TOPIC
+} discovery_field_kind_t;
+
+typedef enum : uint8_t
+{
+    DFC_ALWAYS,
+    DFC_LED_RGB,
+    DFC_LED_WW,
+    DFC_SENSOR,
+    DFC_BINARY_SENSOR
+} discovery_field_condition_t;
+
+typedef struct
+{
+    const char *key;
+    discovery_field_kind_t kind;
+    const char *value;
+    discovery_field_condition_t condition;
+} discovery_field_t;
+
+typedef struct
+{
+    esp_now_device_type_t deviceType;
+    const discovery_field_t *fields;
+    uint8_t fieldsCount;
+    bool isRfSensor; // Unique ID and state topic are built from the RF sensor ID instead of the MAC.
+} discovery_descriptor_t;
+
+typedef void (*payload_writer_t)(Print &output, const void *context);
+
+typedef struct
+{
+    const discovery_descriptor_t *descriptor;
+    JsonDocument *json;
+    esp_now_device_type_t deviceType;
+    const uint8_t *sender;
+    bool isReplayed;
+} discovery_context_t;
+
+struct hashPrint : public Print // Measures and hashes (FNV-1a) the output without storing it.
+{
+    uint32_t hash{2166136261};
+    size_t length{0};
+    size_t write(uint8_t c) override
+    {
+        hash = (hash ^ c) * 16777619;
+        ++length;
+        return 1;
+    }
+};
+
+typedef struct
+{
+    uint32_t tokens{0}; // In thousandths of a token.
+    uint32_t lastRefillTime{0};
+} token_bucket_t;
+
+typedef struct
+{
+    uint32_t topicHash{0};
+    char topic[80]{0};
+    char payload[sizeof(esp_now_payload_data_t::message)]{0};
+    bool retained{false};
+    bool isPending{false}; // Payload is newer than the last published one.
+    uint32_t receivedTime{0}; // Of the frame the payload came from.
+    uint32_t lastPublishTime{0};
+    token_bucket_t bucket;
+} coalesce_slot_t;
+
+typedef struct
+{
+    uint8_t mac[6]{0};
+    esp_now_device_type_t deviceType{ENDT_NONE};
+    char macHex[13]{0};
+    char root[32]{0}; // Device type and MAC part of the topic (without topic prefix).
+    uint32_t lastUsedTime{0}; // For LRU eviction.
+    uint32_t lastSeenTime{0};
+    uint32_t lastKeepAliveTime{0};
+    uint32_t keepAliveInterval{0}; // Measured between keep alive frames. 0 if the device does not send them.
+    uint32_t rxFrames{0}; // 0 if the entry was only created for a topic.
+    uint32_t txFrames{0};
+    bool isOffline{false};
+} device_entry_t;
+
+typedef struct
+{
+    const void *kind; // Tag of the enum type.
+    uint8_t value;
+    const char *name; // Allocated once, never freed.
+} value_name_t;
+
+typedef struct
+{
+    uint32_t jsonFrames{0};
+    uint32_t jsonBytes{0};
+    uint32_t jsonDecodedFrames{0}; // JSON state and attributes are published without decoding.
+    uint32_t jsonDecodeTime{0}; // In microseconds.
+    uint32_t binaryFrames{0};
+    uint32_t binaryBytes{0};
+    uint32_t binaryJsonBytes{0}; // Size of the same payloads as JSON text.
+    uint32_t binaryDecodeTime{0}; // In microseconds.
+} encoding_metrics_t;
+
+typedef struct
+{
+    uint8_t *memory;
+    uint16_t size;
+    std::atomic<bool> isUsed;
+} json_arena_t;
+
+typedef enum : uint8_t
+{
+    CD_RX,
+    CD_TX
+} capture_direction_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint8_t version;
+    uint32_t sequence; // Segments are read in sequence order.
+} capture_segment_header_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t time; // In milliseconds since start.
+    uint8_t direction;
+    uint8_t mac[6]; // Sender or target. FF:FF:FF:FF:FF:FF for broadcast.
+    uint8_t deviceType;
+    uint8_t payloadsType;
+    uint8_t length; // Message length. The message follows without the null terminator.
+} capture_record_t;
+
+// Provided by main.cpp on the device and by the host program.
+void mqttPublish(const char *topic, const char *payload, bool retained);
+void mqttPublish(const char *topic, const size_t length, bool retained, payload_writer_t writer, const void *context);
+const char *getTopicPrefix(void);
+
+void processEspnowMessage(const esp_now_payload_data_t &incomingData, const uint8_t *sender, const uint32_t receivedTime, const bool isReplayed = false);
+void publishEspnowMessage(const esp_now_payload_data_t &incomingData, const uint8_t *sender, const bool isReplayed);
+bool isBinaryPayload(const esp_now_payload_data_t &data);
+uint8_t getPayloadLength(const esp_now_payload_data_t &data);
+bool decodePayload(const esp_now_payload_data_t &data, JsonDocument &json, char *message);
+void publishTranscodedPayload(const char *topic, JsonDocument &json, bool retained, bool isCoalesced);
+void writeJsonDocument(Print &output, const void *context);
+void writeDiscoveryContext(Print &output, const void *context);
+
+device_entry_t *getDevice(const uint8_t *mac, const esp_now_device_type_t deviceType, const bool isReplayed = false);
+void initDeviceEntry(device_entry_t &device, const uint8_t *mac, const esp_now_device_type_t deviceType);
+const char *getReplayTopicSuffix(const bool isReplayed);
+char *buildDeviceTopic(const uint8_t *mac, const esp_now_device_type_t deviceType, const char *suffix, const bool isReplayed = false);
+char *buildUniqueId(const uint8_t *mac, const esp_now_device_type_t deviceType, const uint8_t unit, const bool isReplayed = false);
+char *buildDiscoveryTopic(const char *component, const char *uniqueId, const bool isReplayed = false);
+char *buildRfSensorTopic(const rf_sensor_type_t type, const uint16_t id, const bool isReplayed = false);
+
+const discovery_descriptor_t *getDiscoveryDescriptor(const esp_now_device_type_t deviceType);
+void writeDiscoveryPayload(Print &output, const discovery_descriptor_t &descriptor, JsonDocument &json, const esp_now_device_type_t deviceType, const uint8_t *sender, const bool isReplayed);
+void writeJsonString(Print &output, const char *value);
+
+uint32_t getHash(const char *data, uint32_t hash = 2166136261);
+void publishDiscoveryMessage(const char *topic, payload_writer_t writer, const void *context, const bool isReplayed = false);
+
+void publishCoalesced(const char *topic, const char *payload, bool retained);
+bool publishCoalescedSlot(coalesce_slot_t &slot);
+void flushCoalescedStates(void);
+bool refillTokenBucket(token_bucket_t &bucket, const uint8_t rate, const uint8_t burst);
+
+const uint8_t deviceRegistrySize{32}; // The least recently used device is evicted.
+const uint8_t deviceOfflineFactor{3};
+const char replayTopicSuffix[]{"_replay"}; // Appended to the topic prefix for replayed frames. Keeps them off the live device topics and Home Assistant discovery. // Missed keep alive intervals before a device is reported offline.
+
+const uint8_t valueNamesSize{48}; // Names used by the message path. Only the values actually seen are added.
+
+const uint8_t coalesceSlotsSize{12}; // One slot per state/RF sensor topic. The least recently published idle slot is reused.
+const uint16_t coalesceWindow{250}; // In milliseconds. Minimum interval between publishes to the same topic.
+const uint8_t coalesceDeviceRate{2}; // Tokens per second for each topic.
+const uint8_t coalesceDeviceBurst{4};
+const uint8_t coalesceGlobalRate{20}; // Tokens per second for all topics together.
+const uint8_t coalesceGlobalBurst{30};
+
+const uint8_t binaryPayloadMarker{0xC1}; // Never used in MessagePack and never starts JSON text.
+const uint16_t binaryPayloadCapacity{1024}; // Binary payloads carry more members than JSON text of the same size.
+const uint8_t encodingDeviceTypes{16}; // Covers all ENDT_* values.
+
+const uint16_t jsonSmallArenaSize{256}; // ESP-NOW payload documents.
+const uint16_t jsonMediumArenaSize{1024}; // Gateway attributes and config documents.
+const uint16_t jsonLargeArenaSize{2048}; // Web interface documents.
+
+const uint32_t captureMagic{0x50434E45}; // "ENCP".
+const uint8_t captureVersion{1};
+
+extern device_entry_t deviceRegistry[deviceRegistrySize];
+#if defined(ESP32)
+extern SemaphoreHandle_t deviceRegistryMutex;
+#endif
+extern uint8_t deviceRegistryCount;
+extern char topicBuffer[128];
+extern char discoveryTopicBuffer[128];
+extern char uniqueIdBuffer[20];
+extern value_name_t valueNames[valueNamesSize];
+extern uint8_t valueNamesCount;
+extern char valueNameBuffer[32];
+extern uint8_t discoveryCacheCount;
+extern coalesce_slot_t coalesceSlots[coalesceSlotsSize];
+extern token_bucket_t coalesceGlobalBucket;
+extern uint8_t coalescePendingCount;
+extern uint32_t coalesceMergedCounter;
+extern uint32_t coalesceSuppressedCounter;
+extern uint32_t coalesceBypassedCounter;
+extern encoding_metrics_t encodingMetrics[encodingDeviceTypes];
+extern uint32_t jsonArenaExhaustedCounter;
+extern uint32_t jsonArenaOversizeCounter;
+extern bool isBenchmarkRunning;
+extern uint32_t publishedFrameReceivedTime;
+
+struct PooledJsonAllocator
+{
+    void *allocate(size_t size);
+    void deallocate(void *pointer);
+    void *reallocate(void *pointer, size_t size);
+};
+
+typedef BasicJsonDocument<PooledJsonAllocator> PooledJsonDocument; // ArduinoJson 6 allocates the whole pool at once. Version 7 allocates per string, hence the pinned version.
+
+template <typename T>
+const char *getCachedValueName(const T value) // getValueName() builds a String on every call. For loop() only, the table is not locked.
+{
+    static const uint8_t kind{0}; // One per enum type.
+    for (uint8_t i{0}; i < valueNamesCount; ++i)
+        if (valueNames[i].kind == &kind && valueNames[i].value == value)
+            return valueNames[i].name;
+    String name = getValueName(value);
+    if (valueNamesCount >= valueNamesSize)
+    {
+        strncpy(valueNameBuffer, name.c_str(), sizeof(valueNameBuffer) - 1);
+        return valueNameBuffer;
+    }
+    value_name_t &entry = valueNames[valueNamesCount++];
+    entry.kind = &kind;
+    entry.value = value;
+    entry.name = strdup(name.c_str());
+    return entry.name;
+}
@@ -0,0 +1,109 @@
+#include "mqtt_qos1.h"
+
+mqtt_qos1_publish_result_t addMqttQos1Publish(mqtt_qos1_t &qos1, const uint8_t window, const char *topic, const size_t length, bool retained, payload_writer_t writer, const void *context, const uint32_t now)
+{
+    uint16_t topicLength = strlen(topic);
+    uint32_t remainingLength = topicLength + length + 4; // Plus topic length and packet ID.
+    uint32_t packetLength = remainingLength + (remainingLength < 128 ? 2 : remainingLength < 16384 ? 3 : 4);
+    if (qos1.count >= window || qos1.count >= mqttMaxWindow || packetLength > (uint32_t)(qos1.bufferSize - qos1.used))
+        return MQPR_FULL;
+    uint16_t packetId = qos1.nextPacketId++;
+    if (!qos1.nextPacketId)
+        qos1.nextPacketId = 1; // 0 is not a valid packet ID.
+    memoryPrint output(qos1.buffer + qos1.used, packetLength);
+    output.write(0x32 | (retained ? 0x01 : 0x00)); // PUBLISH, QoS 1.
+    do
+    {
+        output.write((remainingLength & 0x7F) | (remainingLength > 0x7F ? 0x80 : 0x00));
+        remainingLength >>= 7;
+    } while (remainingLength);
+    output.write(topicLength >> 8);
+    output.write(topicLength & 0xFF);
+    output.write((const uint8_t *)topic, topicLength);
+    output.write(packetId >> 8);
+    output.write(packetId & 0xFF);
+    writer(output, context);
+    if (output.length != packetLength)
+        return MQPR_LENGTH_MISMATCH;
+    mqtt_inflight_t &entry = qos1.entries[qos1.count++];
+    entry.packetId = packetId;
+    entry.length = packetLength;
+    entry.sentTime = now;
+    entry.attempts = 1;
+    qos1.used += packetLength;
+    if (qos1.count > qos1.peak)
+        qos1.peak = qos1.count;
+    return MQPR_QUEUED;
+}
+
+const uint8_t *getMqttQos1Packet(const mqtt_qos1_t &qos1, const uint8_t index)
+{
+    uint16_t offset{0};
+    for (uint8_t i{0}; i < index; ++i)
+        offset += qos1.entries[i].length;
+    return qos1.buffer + offset;
+}
+
+bool acknowledgeMqttQos1(mqtt_qos1_t &qos1, const uint8_t *puback)
+{
+    if (puback[0] != 0x40 || puback[1] != 0x02) // PUBACK with a 2 byte remaining length.
+        return false;
+    uint16_t packetId = puback[2] << 8 | puback[3];
+    for (uint8_t i{0}; i < qos1.count; ++i)
+        if (qos1.entries[i].packetId == packetId)
+        {
+            releaseMqttQos1(qos1, i);
+            ++qos1.ackedCounter;
+            return true;
+        }
+    return false; // Duplicate PUBACK of a retransmitted message.
+}
+
+void releaseMqttQos1(mqtt_qos1_t &qos1, const uint8_t index)
+{
+    uint8_t *packet = (uint8_t *)getMqttQos1Packet(qos1, index);
+    uint16_t length = qos1.entries[index].length;
+    memmove(packet, packet + length, qos1.buffer + qos1.used - packet - length);
+    memmove(&qos1.entries[index], &qos1.entries[index + 1], (qos1.count - index - 1) * sizeof(mqtt_inflight_t));
+    qos1.used -= length;
+    --qos1.count;
+}
+
+bool retransmitMqttQos1(mqtt_qos1_t &qos1, Print &output, const uint32_t now)
+{
+    uint16_t offset{0};
+    for (uint8_t i{0}; i < qos1.count; ++i) // In the original order, as required after a reconnect.
+    {
+        mqtt_inflight_t &entry = qos1.entries[i];
+        if (now - entry.sentTime < mqttRetryTimeout)
+        {
+            offset += entry.length;
+            continue;
+        }
+        if (entry.attempts >= mqttMaxAttempts)
+        {
+            ++qos1.lostCounter;
+            releaseMqttQos1(qos1, i--);
+            continue;
+        }
+        qos1.buffer[offset] |= 0x08; // DUP.
+        if (output.write(qos1.buffer + offset, entry.length) != entry.length)
+            return false; // A short write leaves the stream mid packet.
+        entry.sentTime = now;
+        ++entry.attempts;
+        ++qos1.retransmitCounter;
+        offset += entry.length;
+    }
+    return true;
+}
+
+void expireMqttQos1(mqtt_qos1_t &qos1, const uint32_t now)
+{
+    for (uint8_t i{0}; i < qos1.count; ++i)
+        qos1.entries[i].sentTime = now - mqttRetryTimeout; // Sent again by the next retransmitMqttQos1().
+}
+
+bool isMqttQos1WindowOpen(const mqtt_qos1_t &qos1, const uint8_t window, const uint16_t reserve)
+{
+    return qos1.count < window && qos1.bufferSize - qos1.used >= reserve;
+}
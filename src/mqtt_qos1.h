@@ -0,0 +1,64 @@
+#pragma once
+
+#include "message_path.h"
+
+// MQTT QoS 1 publishing with a window of unacknowledged messages. Builds the PUBLISH packets, keeps them for
+// retransmission and releases them on PUBACK. Sending and receiving are left to the caller, so the test builds it
+// on the host against a broker stand-in.
+
+typedef enum : uint8_t
+{
+    MQPR_QUEUED, // Stored in the window. The caller sends it with getMqttQos1Packet() of the newest entry.
+    MQPR_FULL, // Window or buffer full. Nothing is stored.
+    MQPR_LENGTH_MISMATCH // The writer did not produce the announced length. Nothing is stored.
+} mqtt_qos1_publish_result_t;
+
+struct memoryPrint : public Print // Writes into a caller provided buffer. Output beyond its size is counted but not stored.
+{
+    uint8_t *buffer;
+    size_t size;
+    size_t length{0};
+    memoryPrint(uint8_t *buffer, size_t size) : buffer(buffer), size(size) {}
+    size_t write(uint8_t c) override
+    {
+        if (length < size)
+            buffer[length] = c;
+        ++length;
+        return 1;
+    }
+    using Print::write;
+};
+
+const uint8_t mqttMaxWindow{16}; // Upper limit of the configurable QoS 1 window.
+const uint16_t mqttRetryTimeout{5000}; // In milliseconds. Unacknowledged messages are sent again with the DUP flag.
+const uint8_t mqttMaxAttempts{5}; // A message without PUBACK is dropped after this number of transmissions.
+
+typedef struct
+{
+    uint16_t packetId;
+    uint16_t length; // Whole packet. Packets are stored back to back in the order of the entries.
+    uint32_t sentTime;
+    uint8_t attempts;
+} mqtt_inflight_t;
+
+typedef struct
+{
+    uint8_t *buffer; // Whole PUBLISH packets kept for retransmission.
+    uint16_t bufferSize;
+    uint16_t used{0};
+    mqtt_inflight_t entries[mqttMaxWindow]; // Oldest first.
+    uint8_t count{0};
+    uint8_t peak{0};
+    uint16_t nextPacketId{1};
+    uint32_t ackedCounter{0};
+    uint32_t retransmitCounter{0};
+    uint32_t lostCounter{0}; // Dropped after mqttMaxAttempts transmissions.
+} mqtt_qos1_t;
+
+mqtt_qos1_publish_result_t addMqttQos1Publish(mqtt_qos1_t &qos1, const uint8_t window, const char *topic, const size_t length, bool retained, payload_writer_t writer, const void *context, const uint32_t now);
+const uint8_t *getMqttQos1Packet(const mqtt_qos1_t &qos1, const uint8_t index);
+bool acknowledgeMqttQos1(mqtt_qos1_t &qos1, const uint8_t *puback);
+void releaseMqttQos1(mqtt_qos1_t &qos1, const uint8_t index);
+bool retransmitMqttQos1(mqtt_qos1_t &qos1, Print &output, const uint32_t now);
+void expireMqttQos1(mqtt_qos1_t &qos1, const uint32_t now);
+bool isMqttQos1WindowOpen(const mqtt_qos1_t &qos1, const uint8_t window, const uint16_t reserve);
@@ -0,0 +1,504 @@
+#if !defined(PIO_UNIT_TESTING)
+
+#include "message_path.h"
+#include "downlink_path.h"
+#include "ZHNetwork.h"
+#include "PubSubClient.h"
+#include "LittleFS.h"
+#include <malloc.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// Host program of env:native. Runs the ESP-NOW to MQTT message path and the MQTT command to ESP-NOW path without a radio,
+// broker or flash. ZHNetwork, PubSubClient and LittleFS are stand-ins (src/native/stubs).
+//   program bench [iterations]   Time, heap allocations and peak heap per frame for each device and payload type.
+//   program topics [iterations]  The same for the device topics of a config frame, built by String concatenation and from the device table.
+//   program downlink [iterations]
+//                                The same for MQTT commands, from onMqttMessage() to the delivery confirmation and the
+//                                acknowledgement, and for the gateway keep alive frame.
+//   program replay max|original <segment files>
+//                                Feeds the received frames of a capture (http://IP/capture?segment=N) into the message path. At
+//                                maximum speed for throughput, at original speed with the published messages printed.
+
+typedef struct
+{
+    esp_now_device_type_t deviceType;
+    esp_now_payload_type_t payloadsType;
+    const char *message; // Config frames are generated by fillBenchmarkFrame().
+    bool isBinary; // Sent as MessagePack.
+} benchmark_frame_t;
+
+typedef struct
+{
+    uint32_t time{0}; // In nanoseconds per frame.
+    float allocations{0}; // Heap allocations per frame.
+    uint32_t peak{0}; // Maximum heap in bytes in use while a frame is processed.
+    float bytes{0}; // MQTT topic and payload bytes per frame.
+} benchmark_result_t;
+
+typedef struct
+{
+    const char *name;
+    const char *commands[3][2]; // Topic and payload. Sent back to back like the commands of one Home Assistant action.
+} downlink_benchmark_t;
+
+typedef struct
+{
+    File file;
+    uint32_t sequence; // Segments are read in sequence order.
+} replay_segment_t;
+
+struct filePrint : public Print
+{
+    FILE *file;
+    filePrint(FILE *file) : file(file) {}
+    size_t write(uint8_t c) override
+    {
+        return fputc(c, file) == EOF ? 0 : 1;
+    }
+};
+
+typedef uint32_t (*topic_builder_t)(const discovery_descriptor_t &descriptor); // Returns the total topics length.
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *pointer, size_t size);
+extern "C" void __libc_free(void *pointer);
+
+void runBenchmark(const uint32_t iterations);
+void fillBenchmarkFrame(const uint8_t index, esp_now_payload_data_t &data);
+void runTopicBenchmark(const uint32_t iterations);
+benchmark_result_t measureTopicBuilder(topic_builder_t builder, const discovery_descriptor_t &descriptor, const uint32_t iterations);
+uint32_t buildConcatenatedTopics(const discovery_descriptor_t &descriptor);
+uint32_t buildCachedTopics(const discovery_descriptor_t &descriptor);
+String macToString(const uint8_t *mac);
+void runDownlinkBenchmark(const uint32_t iterations);
+void sendDownlinkBenchmarkCommands(const downlink_benchmark_t &benchmark);
+void sendHostKeepAliveMessage(const bool isTimeKnown);
+void onEspnowConfirm(const uint8_t *target, const uint16_t id, const bool status);
+void runReplay(const bool isOriginalSpeed, const int count, char **paths);
+void onAllocation(void *pointer);
+void onFree(void *pointer);
+
+const benchmark_frame_t benchmarkFrames[]{
+    {ENDT_SWITCH, ENPT_STATE, "{\"state\":\"ON\"}", false},
+    {ENDT_SWITCH, ENPT_ATTRIBUTES, "{\"Type\":\"ESP-NOW switch\",\"MCU\":\"ESP8266\",\"MAC\":\"020000000001\",\"Firmware\":\"1.0\",\"Library\":\"1.0\",\"Uptime\":\"Days:0 Hours:0 Mins:1\"}", false},
+    {ENDT_SWITCH, ENPT_ATTRIBUTES, "{\"Type\":\"ESP-NOW switch\",\"MCU\":\"ESP8266\",\"MAC\":\"020000000001\",\"Firmware\":\"1.0\",\"Library\":\"1.0\",\"Uptime\":\"Days:0 Hours:0 Mins:1\"}", true},
+    {ENDT_SWITCH, ENPT_KEEP_ALIVE, "{\"frequency\":10}", false},
+    {ENDT_SWITCH, ENPT_CONFIG, nullptr, false},
+    {ENDT_SWITCH, ENPT_CONFIG, nullptr, true},
+    {ENDT_LED, ENPT_STATE, "{\"state\":\"ON\",\"brightness\":255,\"temperature\":255,\"rgb\":[255,255,255]}", false},
+    {ENDT_LED, ENPT_STATE, "{\"state\":\"ON\",\"brightness\":255,\"temperature\":255,\"rgb\":[255,255,255]}", true},
+    {ENDT_LED, ENPT_CONFIG, nullptr, false},
+    {ENDT_SENSOR, ENPT_STATE, "{\"state\":\"OPEN\",\"battery\":3.2}", false},
+    {ENDT_SENSOR, ENPT_CONFIG, nullptr, false},
+    {ENDT_RF_SENSOR, ENPT_CONFIG, nullptr, false},
+    {ENDT_RF_GATEWAY, ENPT_FORWARD, "{\"type\":1,\"id\":1234,\"temperature\":21.5,\"humidity\":55,\"battery\":3.1}", false},
+    {ENDT_RF_GATEWAY, ENPT_FORWARD, "{\"type\":1,\"id\":1234,\"temperature\":21.5,\"humidity\":55,\"battery\":3.1}", true},
+    {ENDT_RF_GATEWAY, ENPT_CONFIG, nullptr, false}};
+const uint8_t benchmarkFramesCount{sizeof(benchmarkFrames) / sizeof(benchmarkFrames[0])};
+const uint32_t benchmarkIterations{10000};
+const esp_now_device_type_t topicBenchmarkDeviceTypes[]{ENDT_SWITCH, ENDT_LED, ENDT_SENSOR, ENDT_RF_GATEWAY};
+const uint8_t benchmarkSender[6]{0x02, 0x00, 0x00, 0x00, 0x00, 0x01}; // Locally administered MAC.
+const downlink_benchmark_t downlinkBenchmarks[]{
+    {"switch set", {{"homeassistant/espnow_switch/020000000001/set", "ON"}}},
+    {"led set", {{"homeassistant/espnow_led/020000000001/set", "ON"}}},
+    {"led action", {{"homeassistant/espnow_led/020000000001/set", "ON"}, {"homeassistant/espnow_led/020000000001/brightness", "128"}, {"homeassistant/espnow_led/020000000001/rgb", "255,128,0"}}},
+    {"switch update", {{"homeassistant/espnow_switch/020000000001", "update"}}},
+    {"led restart", {{"homeassistant/espnow_led/020000000001", "restart"}}}};
+const uint32_t keepAliveBenchmarkTime{1700000000}; // Epoch time of the keep alive frame with date and time.
+
+ZHNetwork myNet;
+PubSubClient mqttClient;
+bool isMqttAvailable{true};
+
+bool isAllocationCounting{false};
+uint32_t allocationCounter{0};
+size_t heapInUse{0}; // Only counted while isAllocationCounting is set.
+size_t heapPeak{0};
+
+int main(int argc, char **argv)
+{
+    if (argc >= 2 && !strcmp(argv[1], "bench"))
+    {
+        runBenchmark(argc >= 3 ? strtoul(argv[2], nullptr, 10) : benchmarkIterations);
+        return 0;
+    }
+    if (argc >= 2 && !strcmp(argv[1], "topics"))
+    {
+        runTopicBenchmark(argc >= 3 ? strtoul(argv[2], nullptr, 10) : benchmarkIterations);
+        return 0;
+    }
+    if (argc >= 2 && !strcmp(argv[1], "downlink"))
+    {
+        runDownlinkBenchmark(argc >= 3 ? strtoul(argv[2], nullptr, 10) : benchmarkIterations);
+        return 0;
+    }
+    if (argc >= 4 && !strcmp(argv[1], "replay") && (!strcmp(argv[2], "max") || !strcmp(argv[2], "original")))
+    {
+        runReplay(!strcmp(argv[2], "original"), argc - 3, argv + 3);
+        return 0;
+    }
+    fprintf(stderr, "Usage: %s bench|topics|downlink [iterations]\n       %s replay max|original <segment files>\n", argv[0], argv[0]);
+    return 1;
+}
+
+void runBenchmark(const uint32_t iterations)
+{
+    isBenchmarkRunning = true;
+    printf("%-16s %-16s %-11s %10s %12s %10s %12s\n", "Device", "Payload", "Encoding", "ns/frame", "allocs/frame", "peak bytes", "MQTT bytes");
+    for (uint8_t i{0}; i < benchmarkFramesCount; ++i)
+    {
+        esp_now_payload_data_t data;
+        fillBenchmarkFrame(i, data);
+        processEspnowMessage(data, benchmarkSender, 0); // Warm up: registry entry, value names and topic cache.
+        allocationCounter = 0;
+        heapInUse = 0;
+        heapPeak = 0;
+        mqttClient.publishBytes = 0;
+        isAllocationCounting = true;
+        uint32_t startTime = micros();
+        for (uint32_t j{0}; j < iterations; ++j)
+            processEspnowMessage(data, benchmarkSender, 0); // The discovery cache is bypassed, config frames are measured with the message published.
+        uint32_t time = micros() - startTime;
+        isAllocationCounting = false;
+        benchmark_result_t result;
+        result.time = (uint64_t)time * 1000 / iterations;
+        result.allocations = (float)allocationCounter / iterations;
+        result.peak = heapPeak;
+        result.bytes = (float)mqttClient.publishBytes / iterations;
+        printf("%-16s %-16s %-11s %10u %12.2f %10u %12.1f\n", getCachedValueName(data.deviceType), getCachedValueName(data.payloadsType), benchmarkFrames[i].isBinary ? "MessagePack" : "JSON", result.time, result.allocations, result.peak, result.bytes);
+    }
+    isBenchmarkRunning = false;
+}
+
+void fillBenchmarkFrame(const uint8_t index, esp_now_payload_data_t &data)
+{
+    const benchmark_frame_t &frame = benchmarkFrames[index];
+    data.deviceType = frame.deviceType;
+    data.payloadsType = frame.payloadsType;
+    DynamicJsonDocument json(binaryPayloadCapacity);
+    if (frame.message)
+        deserializeJson(json, frame.message);
+    else
+    {
+        json[MCMT_DEVICE_NAME] = "Benchmark";
+        json[MCMT_DEVICE_UNIT] = 1;
+        json[MCMT_VALUE_TEMPLATE] = "state";
+        json[MCMT_PAYLOAD_ON] = "ON";
+        json[MCMT_PAYLOAD_OFF] = "OFF";
+        if (frame.deviceType == ENDT_SWITCH)
+            json[MCMT_COMPONENT_TYPE] = HACT_SWITCH;
+        if (frame.deviceType == ENDT_LED)
+        {
+            json[MCMT_COMPONENT_TYPE] = HACT_LIGHT;
+            json[MCMT_DEVICE_CLASS] = ENLT_RGBWW;
+        }
+        if (frame.deviceType == ENDT_SENSOR || frame.deviceType == ENDT_RF_SENSOR)
+        {
+            json[MCMT_COMPONENT_TYPE] = HACT_SENSOR;
+            json[MCMT_UNIT_OF_MEASUREMENT] = "°C";
+            json[MCMT_EXPIRE_AFTER] = 60;
+        }
+        if (frame.deviceType == ENDT_RF_SENSOR)
+        {
+            json[MCMT_RF_SENSOR_TYPE] = 1;
+            json[MCMT_RF_SENSOR_ID] = 1234;
+        }
+        if (frame.deviceType == ENDT_RF_GATEWAY)
+            json[MCMT_COMPONENT_TYPE] = HACT_BINARY_SENSOR;
+    }
+    if (!frame.isBinary)
+    {
+        serializeJson(json, data.message, sizeof(esp_now_payload_data_t::message));
+        return;
+    }
+    data.message[0] = binaryPayloadMarker;
+    data.message[1] = serializeMsgPack(json, data.message + 2, sizeof(esp_now_payload_data_t::message) - 2);
+}
+
+void runTopicBenchmark(const uint32_t iterations)
+{
+    printf("%-16s %6s %-12s %10s %12s %10s\n", "Device", "Topics", "Method", "ns/frame", "allocs/frame", "peak bytes");
+    for (const esp_now_device_type_t deviceType : topicBenchmarkDeviceTypes)
+    {
+        const discovery_descriptor_t &descriptor = *getDiscoveryDescriptor(deviceType);
+        uint8_t topicsCount{0};
+        for (uint8_t i{0}; i < descriptor.fieldsCount; ++i)
+            if (descriptor.fields[i].kind == DFK_TOPIC)
+                ++topicsCount;
+        benchmark_result_t concatenated = measureTopicBuilder(buildConcatenatedTopics, descriptor, iterations);
+        benchmark_result_t cached = measureTopicBuilder(buildCachedTopics, descriptor, iterations);
+        printf("%-16s %6u %-12s %10u %12.2f %10u\n", getCachedValueName(deviceType), topicsCount, "String", concatenated.time, concatenated.allocations, concatenated.peak);
+        printf("%-16s %6u %-12s %10u %12.2f %10u\n", getCachedValueName(deviceType), topicsCount, "Device table", cached.time, cached.allocations, cached.peak);
+    }
+}
+
+benchmark_result_t measureTopicBuilder(topic_builder_t builder, const discovery_descriptor_t &descriptor, const uint32_t iterations)
+{
+    builder(descriptor); // Warm up: registry entry and value names.
+    allocationCounter = 0;
+    heapInUse = 0;
+    heapPeak = 0;
+    uint64_t length{0};
+    isAllocationCounting = true;
+    uint32_t startTime = micros();
+    for (uint32_t i{0}; i < iterations; ++i)
+        length += builder(descriptor);
+    uint32_t time = micros() - startTime;
+    isAllocationCounting = false;
+    benchmark_result_t result;
+    result.time = (uint64_t)time * 1000 / iterations;
+    result.allocations = (float)allocationCounter / iterations;
+    result.peak = heapPeak;
+    result.bytes = (float)length / iterations;
+    return result;
+}
+
+uint32_t buildConcatenatedTopics(const discovery_descriptor_t &descriptor) // As the gateway built them before the device table.
+{
+    uint32_t length{0};
+    for (uint8_t i{0}; i < descriptor.fieldsCount; ++i)
+        if (descriptor.fields[i].kind == DFK_TOPIC)
+        {
+            String topic = String(getTopicPrefix()) + "/" + getValueName(descriptor.deviceType) + "/" + macToString(benchmarkSender) + "/" + descriptor.fields[i].value;
+            length += topic.length();
+        }
+    return length;
+}
+
+uint32_t buildCachedTopics(const discovery_descriptor_t &descriptor)
+{
+    uint32_t length{0};
+    for (uint8_t i{0}; i < descriptor.fieldsCount; ++i)
+        if (descriptor.fields[i].kind == DFK_TOPIC)
+            length += strlen(buildDeviceTopic(benchmarkSender, descriptor.deviceType, descriptor.fields[i].value));
+    return length;
+}
+
+String macToString(const uint8_t *mac) // As ZHNetwork::macToString().
+{
+    char text[13];
+    snprintf(text, sizeof(text), "%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    return String(text);
+}
+
+void runDownlinkBenchmark(const uint32_t iterations)
+{
+    myNet.setOnConfirmReceivingCallback(onEspnowConfirm);
+    printf("%-16s %8s %12s %12s %10s %12s\n", "Command", "Frames", "ns/command", "allocs/cmd", "peak bytes", "MQTT bytes");
+    for (const downlink_benchmark_t &benchmark : downlinkBenchmarks)
+    {
+        sendDownlinkBenchmarkCommands(benchmark); // Warm up.
+        allocationCounter = 0;
+        heapInUse = 0;
+        heapPeak = 0;
+        mqttClient.publishBytes = 0;
+        myNet.sentCounter = 0;
+        isAllocationCounting = true;
+        uint32_t startTime = micros();
+        for (uint32_t i{0}; i < iterations; ++i)
+            sendDownlinkBenchmarkCommands(benchmark);
+        uint32_t time = micros() - startTime;
+        isAllocationCounting = false;
+        printf("%-16s %8.2f %12u %12.2f %10u %12.1f\n", benchmark.name, (float)myNet.sentCounter / iterations, (uint32_t)((uint64_t)time * 1000 / iterations), (float)allocationCounter / iterations, (uint32_t)heapPeak, (float)mqttClient.publishBytes / iterations);
+    }
+    for (const bool isTimeKnown : {false, true})
+    {
+        sendHostKeepAliveMessage(isTimeKnown);
+        allocationCounter = 0;
+        heapInUse = 0;
+        heapPeak = 0;
+        mqttClient.publishBytes = 0;
+        myNet.sentCounter = 0;
+        isAllocationCounting = true;
+        uint32_t startTime = micros();
+        for (uint32_t i{0}; i < iterations; ++i)
+            sendHostKeepAliveMessage(isTimeKnown);
+        uint32_t time = micros() - startTime;
+        isAllocationCounting = false;
+        printf("%-16s %8.2f %12u %12.2f %10u %12.1f\n", isTimeKnown ? "keep alive+time" : "keep alive", (float)myNet.sentCounter / iterations, (uint32_t)((uint64_t)time * 1000 / iterations), (float)allocationCounter / iterations, (uint32_t)heapPeak, (float)mqttClient.publishBytes / iterations);
+    }
+}
+
+void sendDownlinkBenchmarkCommands(const downlink_benchmark_t &benchmark) // From the MQTT messages to the delivery acknowledgement.
+{
+    char topic[128];
+    for (const auto &command : benchmark.commands)
+    {
+        if (!command[0])
+            break;
+        strncpy(topic, command[0], sizeof(topic) - 1); // Split in place by onMqttMessage().
+        topic[sizeof(topic) - 1] = '\0';
+        onMqttMessage(topic, (byte *)command[1], strlen(command[1]));
+    }
+    for (downlink_command_t &entry : downlinkQueue)
+        if (entry.state == DLS_MERGING)
+            entry.deadline = millis(); // The merge window is not waited for.
+    processDownlinkQueue();
+    myNet.maintenance(); // Confirms the frames.
+    processDownlinkQueue();
+}
+
+void sendHostKeepAliveMessage(const bool isTimeKnown) // As sendKeepAliveMessage() in main.cpp.
+{
+    snprintf(topicBuffer, sizeof(topicBuffer), "%s/espnow_gateway/%s/status", getTopicPrefix(), getGatewayMac());
+    mqttPublish(topicBuffer, "online", true);
+    esp_now_payload_data_t outgoingData;
+    buildKeepAliveMessage(outgoingData, isMqttAvailable, isTimeKnown, keepAliveBenchmarkTime);
+    sendEspnowMessage(outgoingData, nullptr, downlinkNoSlot);
+}
+
+void onEspnowConfirm(const uint8_t *target, const uint16_t id, const bool status)
+{
+    confirmDownlinkCommand(id, status);
+}
+
+void runReplay(const bool isOriginalSpeed, const int count, char **paths)
+{
+    std::vector<replay_segment_t> segments;
+    for (int i{0}; i < count; ++i)
+    {
+        File file = LittleFS.open(paths[i], "r");
+        capture_segment_header_t header;
+        if (!file || file.read((uint8_t *)&header, sizeof(header)) != sizeof(header) || header.magic != captureMagic || header.version != captureVersion)
+        {
+            fprintf(stderr, "Skipped, not a capture segment: %s\n", paths[i]);
+            file.close();
+            continue;
+        }
+        segments.push_back({file, header.sequence});
+    }
+    std::sort(segments.begin(), segments.end(), [](const replay_segment_t &first, const replay_segment_t &second)
+              { return first.sequence < second.sequence; });
+    isBenchmarkRunning = !isOriginalSpeed;
+    filePrint output(stdout);
+    mqttClient.setOutput(isOriginalSpeed ? &output : nullptr);
+    uint32_t frames{0};
+    uint32_t busyTime{0}; // In microseconds spent in the message handling.
+    uint32_t firstTime{0};
+    uint32_t startTime = millis();
+    allocationCounter = 0;
+    isAllocationCounting = true;
+    for (replay_segment_t &segment : segments)
+    {
+        capture_record_t record;
+        esp_now_payload_data_t data;
+        while (segment.file.read((uint8_t *)&record, sizeof(record)) == sizeof(record) && record.length <= sizeof(esp_now_payload_data_t::message))
+        {
+            memset(data.message, 0, sizeof(esp_now_payload_data_t::message));
+            if (segment.file.read((uint8_t *)data.message, record.length) != record.length)
+                break;
+            if (record.direction != CD_RX)
+                continue;
+            if (!frames)
+                firstTime = record.time;
+            while (isOriginalSpeed && record.time - firstTime > millis() - startTime)
+            {
+                flushCoalescedStates();
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            data.deviceType = (esp_now_device_type_t)record.deviceType;
+            data.payloadsType = (esp_now_payload_type_t)record.payloadsType;
+            uint32_t frameStartTime = micros();
+            processEspnowMessage(data, record.mac, 0);
+            busyTime += micros() - frameStartTime;
+            ++frames;
+        }
+        segment.file.close();
+    }
+    while (isOriginalSpeed && coalescePendingCount)
+    {
+        flushCoalescedStates();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    isAllocationCounting = false;
+    isBenchmarkRunning = false;
+    mqttClient.setOutput(nullptr);
+    fprintf(stderr, "%u frames from %u segments, %u us in the message handling (%.0f frames/s), %.2f allocations/frame\n", frames, (uint32_t)segments.size(), busyTime, busyTime ? frames * 1000000.0 / busyTime : 0, frames ? (float)allocationCounter / frames : 0);
+}
+
+void mqttPublish(const char *topic, const char *payload, bool retained)
+{
+    mqttClient.publish(topic, payload, retained);
+}
+
+void mqttPublish(const char *topic, const size_t length, bool retained, payload_writer_t writer, const void *context)
+{
+    mqttClient.beginPublish(topic, length, retained); // Serialization cost is part of the measurement.
+    writer(mqttClient, context);
+    mqttClient.endPublish();
+}
+
+void sendEspnowMessage(const esp_now_payload_data_t &data, const uint8_t *target, const uint8_t slot) // As on ESP8266, without the radio task.
+{
+    char temp[sizeof(esp_now_payload_data_t)]{0};
+    memcpy(&temp, &data, sizeof(esp_now_payload_data_t));
+    uint16_t id = target ? myNet.sendUnicastMessage(temp, target, slot != downlinkNoSlot) : myNet.sendBroadcastMessage(temp);
+    if (slot != downlinkNoSlot)
+        downlinkQueue[slot].messageId = id;
+}
+
+const char *getGatewayMac()
+{
+    return "020000000000";
+}
+
+void restartGateway()
+{
+}
+
+const char *getTopicPrefix()
+{
+    return "homeassistant";
+}
+
+void onAllocation(void *pointer)
+{
+    if (!isAllocationCounting || !pointer)
+        return;
+    ++allocationCounter;
+    heapInUse += malloc_usable_size(pointer);
+    if (heapInUse > heapPeak)
+        heapPeak = heapInUse;
+}
+
+void onFree(void *pointer)
+{
+    if (!isAllocationCounting || !pointer)
+        return;
+    size_t size = malloc_usable_size(pointer);
+    heapInUse = heapInUse > size ? heapInUse - size : 0; // Blocks allocated before the measurement are freed during it.
+}
+
+extern "C" void *malloc(size_t size)
+{
+    void *pointer = __libc_malloc(size);
+    onAllocation(pointer);
+    return pointer;
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    void *pointer = __libc_calloc(count, size);
+    onAllocation(pointer);
+    return pointer;
+}
+
+extern "C" void *realloc(void *pointer, size_t size)
+{
+    onFree(pointer);
+    void *result = __libc_realloc(pointer, size);
+    onAllocation(result);
+    return result;
+}
+
+extern "C" void free(void *pointer)
+{
+    onFree(pointer);
+    __libc_free(pointer);
+}
+
+#endif
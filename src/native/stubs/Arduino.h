@@ -0,0 +1,65 @@
+#pragma once
+
+// Host stand-in for the Arduino core (env:native). Only what the message path, ArduinoJson and ZHConfig use.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <chrono>
+#include <string>
+
+typedef uint8_t byte;
+
+inline unsigned long millis()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline unsigned long micros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void delay(unsigned long) {}
+
+inline void yield() {}
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size)
+    {
+        size_t length{0};
+        while (size--)
+            length += write(*buffer++);
+        return length;
+    }
+    size_t write(const char *text) { return write((const uint8_t *)text, strlen(text)); }
+    size_t print(const char *text) { return write(text); }
+};
+
+class String
+{
+public:
+    String(const char *text = "") : value(text ? text : "") {}
+    const char *c_str() const { return value.c_str(); }
+    unsigned int length() const { return value.length(); }
+    String &operator+=(const String &other)
+    {
+        value += other.value;
+        return *this;
+    }
+    friend String operator+(String first, const String &second) // Appends to the left operand like Arduino's StringSumHelper.
+    {
+        first += second;
+        return first;
+    }
+    bool operator==(const String &other) const { return value == other.value; }
+    bool operator!=(const String &other) const { return value != other.value; }
+
+private:
+    std::string value;
+};
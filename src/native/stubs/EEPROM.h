@@ -0,0 +1,39 @@
+#pragma once
+
+// Host stand-in for the EEPROM library (env:native). The emulated flash sector is kept in memory and starts erased.
+
+#include "Arduino.h"
+#include <vector>
+
+class EEPROMClass
+{
+public:
+    void begin(size_t size) { image.resize(size, 0xFF); }
+    uint8_t read(int address) { return address < (int)image.size() ? image[address] : 0xFF; }
+    void write(int address, uint8_t value)
+    {
+        if (address < (int)image.size())
+            image[address] = value;
+    }
+    template <typename T>
+    T &get(int address, T &value)
+    {
+        if (address + sizeof(T) <= image.size())
+            memcpy(&value, image.data() + address, sizeof(T));
+        return value;
+    }
+    template <typename T>
+    const T &put(int address, const T &value)
+    {
+        if (address + sizeof(T) <= image.size())
+            memcpy(image.data() + address, &value, sizeof(T));
+        return value;
+    }
+    bool commit() { return true; }
+    bool end() { return true; }
+
+private:
+    std::vector<uint8_t> image;
+};
+
+inline EEPROMClass EEPROM;
@@ -0,0 +1,61 @@
+#pragma once
+
+// Host stand-in for LittleFS (env:native). Paths are host file paths.
+
+#include "Arduino.h"
+
+namespace fs
+{
+    class File : public Print
+    {
+    public:
+        File(FILE *file = nullptr) : file(file) {}
+        explicit operator bool() const { return file; }
+        size_t write(uint8_t c) override { return fputc(c, file) == EOF ? 0 : 1; }
+        size_t write(const uint8_t *buffer, size_t size) override { return fwrite(buffer, 1, size, file); }
+        size_t read(uint8_t *buffer, size_t size) { return fread(buffer, 1, size, file); }
+        bool seek(uint32_t position) { return !fseek(file, position, SEEK_SET); }
+        size_t position() { return ftell(file); }
+        size_t size()
+        {
+            long current = ftell(file);
+            fseek(file, 0, SEEK_END);
+            long end = ftell(file);
+            fseek(file, current, SEEK_SET);
+            return end;
+        }
+        void close()
+        {
+            if (file)
+                fclose(file);
+            file = nullptr;
+        }
+
+    private:
+        FILE *file;
+    };
+
+    class FS
+    {
+    public:
+        bool begin() { return true; }
+        File open(const char *path, const char *mode)
+        {
+            const char *hostMode = !strcmp(mode, "w") ? "wb" : !strcmp(mode, "a") ? "ab" : !strcmp(mode, "r+") ? "r+b" : "rb";
+            return File(fopen(path, hostMode));
+        }
+        bool exists(const char *path)
+        {
+            FILE *file = fopen(path, "rb");
+            if (file)
+                fclose(file);
+            return file;
+        }
+        bool remove(const char *path) { return !::remove(path); }
+        bool rename(const char *from, const char *to) { return !::rename(from, to); }
+    };
+}
+
+using fs::File;
+
+inline fs::FS LittleFS;
@@ -0,0 +1,47 @@
+#pragma once
+
+// Host stand-in for PubSubClient (env:native). Always connected. Published topics and payloads are counted, and written
+// to the output if one is set.
+
+#include "Arduino.h"
+
+class PubSubClient : public Print
+{
+public:
+    bool connected() { return true; }
+    bool publish(const char *topic, const char *payload, bool retained = false)
+    {
+        return beginPublish(topic, strlen(payload), retained) && write((const uint8_t *)payload, strlen(payload)) == strlen(payload) && endPublish();
+    }
+    bool beginPublish(const char *topic, unsigned int length, bool retained)
+    {
+        ++publishCounter;
+        publishBytes += strlen(topic);
+        if (output)
+        {
+            output->print(topic);
+            output->print(" ");
+        }
+        return true;
+    }
+    size_t write(uint8_t c) override
+    {
+        ++publishBytes;
+        if (output)
+            output->write(c);
+        return 1;
+    }
+    using Print::write;
+    int endPublish()
+    {
+        if (output)
+            output->print("\n");
+        return 1;
+    }
+    void setOutput(Print *target) { output = target; }
+    uint32_t publishCounter{0};
+    uint64_t publishBytes{0};
+
+private:
+    Print *output{nullptr};
+};
@@ -0,0 +1,20 @@
+#pragma once
+
+// Host stand-in for Ticker (env:native). Callbacks are not scheduled, the host program calls them itself.
+
+#include "Arduino.h"
+
+class Ticker
+{
+public:
+    typedef void (*callback_t)(void);
+    void attach(float seconds, callback_t function)
+    {
+        callback = function;
+    }
+    void detach() { callback = nullptr; }
+    bool active() { return callback; }
+
+private:
+    callback_t callback{nullptr};
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+// Host stand-in for ZHNetwork (env:native). Frames are counted instead of sent. Unicast frames sent with a confirmation
+// request are confirmed as delivered by the next maintenance() call, as the library does from its own.
+
+#include "Arduino.h"
+#include <vector>
+
+typedef void (*on_message_t)(const char *, const uint8_t *);
+typedef void (*on_confirm_t)(const uint8_t *, const uint16_t, const bool);
+
+class ZHNetwork
+{
+public:
+    void setOnConfirmReceivingCallback(on_confirm_t callback) { onConfirm = callback; }
+    uint16_t sendBroadcastMessage(const char *data)
+    {
+        return send(data, nullptr, false);
+    }
+    uint16_t sendUnicastMessage(const char *data, const uint8_t *target, const bool confirm = false)
+    {
+        return send(data, target, confirm);
+    }
+    void maintenance()
+    {
+        for (const pending_confirm_t &pending : pendingConfirms)
+            if (onConfirm)
+                onConfirm(pending.target, pending.id, true);
+        pendingConfirms.clear();
+    }
+    String getNodeMac() { return String("020000000000"); }
+    String getFirmwareVersion() { return String("host"); }
+    uint32_t sentCounter{0};
+
+private:
+    typedef struct
+    {
+        uint8_t target[6];
+        uint16_t id;
+    } pending_confirm_t;
+    uint16_t send(const char *data, const uint8_t *target, const bool confirm)
+    {
+        ++sentCounter;
+        if (!++messageId)
+            messageId = 1;
+        if (target && confirm)
+        {
+            pending_confirm_t pending;
+            memcpy(pending.target, target, 6);
+            pending.id = messageId;
+            pendingConfirms.push_back(pending);
+        }
+        return messageId;
+    }
+    on_confirm_t onConfirm{nullptr};
+    uint16_t messageId{0};
+    std::vector<pending_confirm_t> pendingConfirms;
+};
@@ -0,0 +1,283 @@
+#include <unity.h>
+#include "mqtt_qos1.h"
+#include <string>
+#include <vector>
+
+// QoS 1 window against a broker stand-in that parses the PUBLISH packets, may lose or cut them and answers with PUBACK.
+
+typedef struct
+{
+    uint16_t packetId;
+    bool isDuplicate;
+    bool isRetained;
+    std::string topic;
+    std::string payload;
+} broker_message_t;
+
+struct brokerStandIn : public Print
+{
+    std::vector<broker_message_t> received;
+    std::vector<uint16_t> pendingAcks; // PUBACKs not yet delivered to the client.
+    uint32_t packetCounter{0};
+    uint32_t lossInterval{0}; // Every Nth packet is lost on the way. 0 for none.
+    size_t writeLimit{SIZE_MAX}; // Bytes accepted by a write.
+    size_t write(uint8_t c) override
+    {
+        return write(&c, 1);
+    }
+    size_t write(const uint8_t *buffer, size_t size) override // One call per packet.
+    {
+        if (size > writeLimit)
+            return writeLimit;
+        ++packetCounter;
+        if (lossInterval && packetCounter % lossInterval == 0)
+            return size;
+        receive(buffer, size);
+        return size;
+    }
+    void receive(const uint8_t *packet, size_t size)
+    {
+        TEST_ASSERT_EQUAL_HEX8(0x32, packet[0] & 0xF6); // PUBLISH, QoS 1.
+        uint32_t remainingLength{0};
+        uint8_t shift{0};
+        size_t i{1};
+        do
+        {
+            remainingLength |= (uint32_t)(packet[i] & 0x7F) << shift;
+            shift += 7;
+        } while (packet[i++] & 0x80);
+        TEST_ASSERT_EQUAL_UINT32(size, i + remainingLength);
+        uint16_t topicLength = packet[i] << 8 | packet[i + 1];
+        i += 2;
+        broker_message_t message;
+        message.topic.assign((const char *)packet + i, topicLength);
+        i += topicLength;
+        message.packetId = packet[i] << 8 | packet[i + 1];
+        i += 2;
+        message.payload.assign((const char *)packet + i, size - i);
+        message.isDuplicate = packet[0] & 0x08;
+        message.isRetained = packet[0] & 0x01;
+        TEST_ASSERT_NOT_EQUAL(0, message.packetId);
+        received.push_back(message);
+        pendingAcks.push_back(message.packetId);
+    }
+    void sendAcks(mqtt_qos1_t &qos1)
+    {
+        for (uint16_t packetId : pendingAcks)
+        {
+            uint8_t puback[4]{0x40, 0x02, (uint8_t)(packetId >> 8), (uint8_t)(packetId & 0xFF)};
+            acknowledgeMqttQos1(qos1, puback);
+        }
+        pendingAcks.clear();
+    }
+};
+
+uint8_t buffer[1024];
+mqtt_qos1_t qos1{buffer, sizeof(buffer)};
+brokerStandIn broker;
+
+void writeText(Print &output, const void *context)
+{
+    const char *text = (const char *)context;
+    output.write((const uint8_t *)text, strlen(text));
+}
+
+mqtt_qos1_publish_result_t publish(const uint8_t window, const char *topic, const char *payload, const uint32_t now, bool retained = false)
+{
+    mqtt_qos1_publish_result_t result = addMqttQos1Publish(qos1, window, topic, strlen(payload), retained, writeText, payload, now);
+    if (result == MQPR_QUEUED)
+        broker.write(getMqttQos1Packet(qos1, qos1.count - 1), qos1.entries[qos1.count - 1].length);
+    return result;
+}
+
+void setUp(void)
+{
+    qos1 = mqtt_qos1_t{buffer, sizeof(buffer)};
+    broker = brokerStandIn();
+}
+
+void tearDown(void)
+{
+}
+
+void test_publish_packet(void)
+{
+    const uint8_t expected[]{0x33, 10, 0, 3, 'a', '/', 'b', 0, 1, 'x', 'y', 'z'};
+    TEST_ASSERT_EQUAL(MQPR_QUEUED, publish(8, "a/b", "xyz", 0, true));
+    TEST_ASSERT_EQUAL_UINT16(sizeof(expected), qos1.used);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, buffer, sizeof(expected));
+    TEST_ASSERT_EQUAL(1, broker.received.size());
+    TEST_ASSERT_TRUE(broker.received[0].isRetained);
+    TEST_ASSERT_FALSE(broker.received[0].isDuplicate);
+}
+
+void test_long_packet_length(void)
+{
+    std::string payload(200, 'p');
+    TEST_ASSERT_EQUAL(MQPR_QUEUED, publish(8, "topic", payload.c_str(), 0));
+    TEST_ASSERT_EQUAL(1, broker.received.size());
+    TEST_ASSERT_EQUAL_STRING(payload.c_str(), broker.received[0].payload.c_str());
+}
+
+void test_window_pipelines_messages(void)
+{
+    for (uint8_t i{0}; i < 4; ++i)
+        TEST_ASSERT_EQUAL(MQPR_QUEUED, publish(4, "t", "m", 0));
+    TEST_ASSERT_EQUAL(MQPR_FULL, publish(4, "t", "m", 0));
+    TEST_ASSERT_EQUAL(4, broker.received.size()); // Sent without waiting for PUBACK.
+    TEST_ASSERT_FALSE(isMqttQos1WindowOpen(qos1, 4, 0));
+    broker.sendAcks(qos1);
+    TEST_ASSERT_EQUAL(0, qos1.count);
+    TEST_ASSERT_EQUAL_UINT16(0, qos1.used);
+    TEST_ASSERT_EQUAL_UINT32(4, qos1.ackedCounter);
+    TEST_ASSERT_EQUAL(4, qos1.peak);
+    TEST_ASSERT_EQUAL(MQPR_QUEUED, publish(4, "t", "m", 0));
+}
+
+void test_puback_releases_out_of_order(void)
+{
+    publish(8, "t", "first", 0);
+    publish(8, "t", "second", 0);
+    publish(8, "t", "third", 0);
+    uint8_t puback[4]{0x40, 0x02, 0x00, 0x02};
+    TEST_ASSERT_TRUE(acknowledgeMqttQos1(qos1, puback));
+    TEST_ASSERT_FALSE(acknowledgeMqttQos1(qos1, puback)); // Duplicate PUBACK.
+    TEST_ASSERT_EQUAL(2, qos1.count);
+    TEST_ASSERT_EQUAL_UINT16(qos1.entries[0].length + qos1.entries[1].length, qos1.used);
+    broker = brokerStandIn();
+    expireMqttQos1(qos1, 0);
+    TEST_ASSERT_TRUE(retransmitMqttQos1(qos1, broker, 0));
+    TEST_ASSERT_EQUAL(2, broker.received.size());
+    TEST_ASSERT_EQUAL_STRING("first", broker.received[0].payload.c_str());
+    TEST_ASSERT_EQUAL_UINT16(3, broker.received[1].packetId);
+    TEST_ASSERT_EQUAL_STRING("third", broker.received[1].payload.c_str());
+}
+
+void test_invalid_puback_ignored(void)
+{
+    publish(8, "t", "m", 0);
+    uint8_t puback[4]{0x40, 0x03, 0x00, 0x01};
+    TEST_ASSERT_FALSE(acknowledgeMqttQos1(qos1, puback));
+    TEST_ASSERT_EQUAL(1, qos1.count);
+}
+
+void test_retransmit_after_timeout(void)
+{
+    broker.lossInterval = 1;
+    publish(8, "t", "lost", 1000);
+    broker.lossInterval = 0;
+    TEST_ASSERT_TRUE(retransmitMqttQos1(qos1, broker, 1000 + mqttRetryTimeout - 1));
+    TEST_ASSERT_EQUAL(0, broker.received.size());
+    TEST_ASSERT_TRUE(retransmitMqttQos1(qos1, broker, 1000 + mqttRetryTimeout));
+    TEST_ASSERT_EQUAL(1, broker.received.size());
+    TEST_ASSERT_TRUE(broker.received[0].isDuplicate);
+    TEST_ASSERT_EQUAL_UINT16(1, broker.received[0].packetId);
+    TEST_ASSERT_EQUAL_STRING("lost", broker.received[0].payload.c_str());
+    TEST_ASSERT_EQUAL_UINT32(1, qos1.retransmitCounter);
+}
+
+void test_retransmit_after_reconnect(void)
+{
+    publish(8, "t", "first", 0);
+    publish(8, "t", "second", 0);
+    broker = brokerStandIn(); // New connection, the persistent session expects both again.
+    expireMqttQos1(qos1, 100);
+    TEST_ASSERT_TRUE(retransmitMqttQos1(qos1, broker, 100));
+    TEST_ASSERT_EQUAL(2, broker.received.size());
+    TEST_ASSERT_EQUAL_STRING("first", broker.received[0].payload.c_str());
+    TEST_ASSERT_EQUAL_STRING("second", broker.received[1].payload.c_str());
+    TEST_ASSERT_TRUE(broker.received[1].isDuplicate);
+}
+
+void test_dropped_after_max_attempts(void)
+{
+    broker.lossInterval = 1;
+    uint32_t now{0};
+    publish(8, "t", "m", now);
+    for (uint8_t i{1}; i < mqttMaxAttempts; ++i)
+    {
+        now += mqttRetryTimeout;
+        retransmitMqttQos1(qos1, broker, now);
+        TEST_ASSERT_EQUAL(1, qos1.count);
+    }
+    TEST_ASSERT_EQUAL_UINT32(mqttMaxAttempts, broker.packetCounter);
+    now += mqttRetryTimeout;
+    retransmitMqttQos1(qos1, broker, now);
+    TEST_ASSERT_EQUAL(0, qos1.count);
+    TEST_ASSERT_EQUAL_UINT32(1, qos1.lostCounter);
+}
+
+void test_short_write_reported(void)
+{
+    publish(8, "t", "m", 0);
+    broker.writeLimit = 3;
+    TEST_ASSERT_FALSE(retransmitMqttQos1(qos1, broker, mqttRetryTimeout));
+    TEST_ASSERT_EQUAL(1, qos1.count); // Sent again over the next connection.
+}
+
+void test_buffer_full(void)
+{
+    uint8_t smallBuffer[16];
+    qos1 = mqtt_qos1_t{smallBuffer, sizeof(smallBuffer)};
+    TEST_ASSERT_EQUAL(MQPR_QUEUED, publish(8, "t", "12345678", 0));
+    TEST_ASSERT_EQUAL(MQPR_FULL, publish(8, "t", "12345678", 0));
+    TEST_ASSERT_FALSE(isMqttQos1WindowOpen(qos1, 8, 4));
+}
+
+void test_length_mismatch(void)
+{
+    TEST_ASSERT_EQUAL(MQPR_LENGTH_MISMATCH, addMqttQos1Publish(qos1, 8, "t", 10, false, writeText, "short", 0));
+    TEST_ASSERT_EQUAL(0, qos1.count);
+    TEST_ASSERT_EQUAL_UINT16(0, qos1.used);
+}
+
+void test_at_least_once_delivery(void)
+{
+    const uint16_t messagesCount{200};
+    const uint8_t window{8};
+    std::vector<std::string> payloads;
+    for (uint16_t i{0}; i < messagesCount; ++i)
+        payloads.push_back("message " + std::to_string(i));
+    broker.lossInterval = 3;
+    uint16_t next{0};
+    uint32_t now{0};
+    uint32_t roundTrips{0};
+    while ((next < messagesCount || qos1.count) && roundTrips < 1000)
+    {
+        while (next < messagesCount && publish(window, "t", payloads[next].c_str(), now) == MQPR_QUEUED)
+            ++next;
+        broker.sendAcks(qos1);
+        now += 1000;
+        TEST_ASSERT_TRUE(retransmitMqttQos1(qos1, broker, now));
+        ++roundTrips;
+    }
+    TEST_ASSERT_EQUAL(0, qos1.count);
+    TEST_ASSERT_EQUAL_UINT32(0, qos1.lostCounter);
+    for (const std::string &payload : payloads)
+    {
+        bool isReceived{false};
+        for (const broker_message_t &message : broker.received)
+            isReceived |= message.payload == payload;
+        TEST_ASSERT_TRUE_MESSAGE(isReceived, payload.c_str());
+    }
+    TEST_ASSERT_EQUAL(window, qos1.peak);
+    TEST_ASSERT_LESS_THAN_UINT32(messagesCount / 2, roundTrips); // Not one message per round trip.
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_publish_packet);
+    RUN_TEST(test_long_packet_length);
+    RUN_TEST(test_window_pipelines_messages);
+    RUN_TEST(test_puback_releases_out_of_order);
+    RUN_TEST(test_invalid_puback_ignored);
+    RUN_TEST(test_retransmit_after_timeout);
+    RUN_TEST(test_retransmit_after_reconnect);
+    RUN_TEST(test_dropped_after_max_attempts);
+    RUN_TEST(test_short_write_reported);
+    RUN_TEST(test_buffer_full);
+    RUN_TEST(test_length_mismatch);
+    RUN_TEST(test_at_least_once_delivery);
+    return UNITY_END();
+}